@@ -40,14 +40,27 @@ Andrey Dobrovolsky <andrey.dobrovolsky.odessa@gmail.com>
 #define _GNU_SOURCE 1
 
 #include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
 #include <sys/param.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/times.h>
 #include <sys/wait.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
 #include <inttypes.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -204,12 +217,40 @@ static void sha256_update(struct sha256 *s, const void *m, unsigned long len)
 
 /********************* Globals *********************************************/
 
-static int wflag, eflag, fflag, tflag, log_fd, indent;
+static int wflag, eflag, fflag, tflag, yflag, nflag, kflag, log_fd, indent,
+		durability;
+
+static double load_max, pressure_max;
+
+enum counters {
+	STATS,		/* stat() family calls */
+	ACCESSES,	/* access() calls by find_recipe() */
+	OPENS,		/* files opened */
+	HASHED,		/* bytes hashed by rehash() */
+	CACHED,		/* hashes found in the hash cache */
+	JOURNALS,	/* journals scanned by find_record() */
+	RECORDS,	/* journal records read */
+	RECIPES,	/* recipes run */
+	REMOTES,	/* recipes run by the workers */
+	BUSIES,		/* targets found BUSY */
+	RETRIES,	/* retry passes */
+	SLEPT,		/* ms slept by hurry_up_on() */
+	THROTTLED,	/* ms slept by throttle() */
+	PROCESSES,	/* redo processes reported */
+	COUNTERS
+};
 
-static struct {
+static long counter[COUNTERS];
+static FILE *stats_f;	/* the counters of the children, see stats_open() */
+
+#define count(c, n)	(counter[c] += (n))
+
+typedef struct {
 	char	*buf;
 	size_t	size, used;
-} track;
+} buffer;
+
+static buffer track, records;
 
 #define HASH_LEN	32
 #define HEXHASH_LEN	(2 * HASH_LEN)
@@ -239,6 +280,9 @@ static const char
 
 	dirup[] = "../",
 
+	pool_suffix[]	= ".pool",
+	pool_prefix[]	= "redo-pool.",
+
 	open_comment[]	=
 
 "--[====================================================================[\n",
@@ -267,6 +311,320 @@ pperror(const char *s)
 }
 
 
+enum errors {
+	OK	= 0,
+	ERROR	= 1,
+	BUSY	= EX_TEMPFAIL
+};
+
+#define ERRORS 0xff
+
+
+enum hints {
+	IS_SOURCE		= 0x100,
+	UPDATED_RECENTLY	= 0x200,
+	IMMEDIATE_DEPENDENCY	= 0x400,
+	OUT_OF_DATE		= 0x800	/* would be rebuilt, -y only */
+};
+
+#define HINTS (~ERRORS)
+
+
+static int
+buffer_add(buffer *b, const char *s, size_t len)
+{
+	if (b->size - b->used <= len) {
+		size_t new_size = b->size + len + PATH_MAX;
+		char  *new_buf = realloc(b->buf, new_size);
+
+		if (!new_buf) {
+			pperror("realloc");
+			return ERROR;
+		}
+		b->size = new_size;
+		b->buf  = new_buf;
+	}
+
+	memcpy(b->buf + b->used, s, len);
+	b->used += len;
+	b->buf[b->used] = '\0';
+
+	return OK;
+}
+
+
+/*
+	Directories are referred by their indices in the cache. Each one
+	keeps its physical path, see fd_path(), for the track and the
+	descriptor for *at() calls. The path is resolved only once per
+	lexical name. No more than DIRS_FDS descriptors are kept open, the
+	evicted ones are reopened by path on demand. redo never changes its
+	cwd, only the forked recipes enter their directories. The
+	recipe may remove and recreate the directories, so all the
+	descriptors are dropped after every recipe, and so are the
+	directories' sibling indices read meanwhile, see sibling_listed().
+*/
+
+typedef struct {
+	char	*key,		/* parent's path, '/', relative name */
+		*path,		/* physical path */
+		*siblings;	/* sibling index or 0 if not read yet */
+	int	fd;
+} folder;
+
+static struct {
+	folder	*dir;
+	int	*slot,	/* open addressing hash of the dir indices + 1 */
+		num, size, fds, hand, home;
+	char	*key;	/* lookup buffer */
+	size_t	key_size;
+} dirs;
+
+#define DIRS_FDS 64
+
+
+static unsigned
+dirs_hash(const char *s)
+{
+	unsigned h = 2166136261u;
+
+	while (*s)
+		h = (h ^ (unsigned char) *s++) * 16777619u;
+
+	return h;
+}
+
+
+static int
+dirs_find(const char *key)
+{
+	int i = dirs_hash(key) & (dirs.size - 1);
+
+	while (dirs.slot[i] && strcmp(dirs.dir[dirs.slot[i] - 1].key, key))
+		i = (i + 1) & (dirs.size - 1);
+
+	return i;
+}
+
+
+static int
+dirs_add(char *key, char *path, int fd)
+{
+	int i;
+
+	if (2 * (dirs.num + 1) > dirs.size) {
+		int	size = dirs.size ? 2 * dirs.size : 64,
+			*slot = calloc(size, sizeof (int));
+		folder *dir = realloc(dirs.dir, size / 2 * sizeof (folder));
+
+		if (!slot || !dir) {
+			perror("dirs");
+			exit(ERROR);
+		}
+
+		free(dirs.slot);
+		dirs.slot = slot;
+		dirs.dir  = dir;
+		dirs.size = size;
+
+		for (i = 0; i < dirs.num; i++)
+			dirs.slot[dirs_find(dirs.dir[i].key)] = i + 1;
+	}
+
+	dirs.dir[dirs.num].key  = key;
+	dirs.dir[dirs.num].path = path;
+	dirs.dir[dirs.num].siblings = 0;
+	dirs.dir[dirs.num].fd   = fd;
+	dirs.slot[dirs_find(key)] = dirs.num + 1;
+
+	if (fd >= 0)
+		dirs.fds++;
+
+	return dirs.num++;
+}
+
+
+static void
+dirs_evict(int keep)
+{
+	while (dirs.fds >= DIRS_FDS) {
+		folder *d = dirs.dir + dirs.hand;
+
+		if ((dirs.hand != keep) && (d->fd >= 0)) {
+			close(d->fd);
+			d->fd = -1;
+			dirs.fds--;
+		}
+		dirs.hand = (dirs.hand + 1) % dirs.num;
+	}
+}
+
+
+static int
+at(int dir)
+{
+	folder *d = dirs.dir + dir;
+
+	if (d->fd < 0) {
+		dirs_evict(dir);
+		d->fd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		count(OPENS, 1);
+		if (d->fd < 0)
+			pperror(d->path);
+		else
+			dirs.fds++;
+	}
+
+	return d->fd;
+}
+
+
+static void
+dirs_drop(void)
+{
+	int i;
+
+	for (i = 0; i < dirs.num; i++) {
+		if (dirs.dir[i].fd >= 0) {
+			close(dirs.dir[i].fd);
+			dirs.dir[i].fd = -1;
+		}
+		free(dirs.dir[i].siblings);
+		dirs.dir[i].siblings = 0;
+	}
+
+	dirs.fds = 0;
+}
+
+
+#define dir_path(d)	(dirs.dir[d].path + 0)
+
+
+static void
+dirs_init(void)
+{
+	char *cwd;
+
+	dirs.home = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	cwd = getcwd(0, 0);
+
+	if ((dirs.home < 0) || !cwd) {
+		perror("cwd");
+		exit(ERROR);
+	}
+
+	dirs_add(strdup(cwd), cwd, -1);
+}
+
+
+/*
+	Returns the physical path of the open directory as the kernel has
+	resolved it, without entering it. Where /proc is not mounted the
+	lexical path is kept, it names the same directory anyway.
+*/
+
+static char *
+fd_path(int fd, const char *lexical)
+{
+	char link[sizeof "/proc/self/fd/" + 3 * sizeof(int)], path[PATH_MAX];
+	ssize_t len;
+
+	sprintf(link, "/proc/self/fd/%d", fd);
+	len = readlink(link, path, sizeof path - 1);
+	count(STATS, 1);
+
+	if ((len <= 0) || (*path != '/'))
+		return strdup(lexical);
+	path[len] = '\0';
+
+	return strdup(path);
+}
+
+
+/*
+	Returns the name of the file inside its directory, updating dir.
+*/
+
+static char *
+dir_enter(int *dir, char *name)
+{
+	char	*slash = strrchr(name, '/'),
+		*parent = dir_path(*dir),
+		*path;
+
+	size_t key_len;
+
+	int i, fd;
+
+
+	if (!slash)
+		return name;
+
+	key_len = strlen(parent) + (slash - name) + 2;
+
+	if (dirs.key_size < key_len) {
+		char *key = realloc(dirs.key, key_len);
+
+		if (!key) {
+			pperror("realloc");
+			return 0;
+		}
+		dirs.key = key;
+		dirs.key_size = key_len;
+	}
+
+	*slash = '\0';
+	if (*name == '/')
+		strcpy(dirs.key, name);
+	else
+		stpcpy(stpcpy(stpcpy(dirs.key, parent), "/"), name);
+	if (slash == name)
+		strcpy(dirs.key, "/");
+	*slash = '/';
+
+	i = dirs.slot[dirs_find(dirs.key)];
+	if (i) {
+		*dir = i - 1;
+		return slash + 1;
+	}
+
+	*slash = '\0';
+	fd = openat(at(*dir), (slash == name) ? "/" : name,
+					O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	*slash = '/';
+	count(OPENS, 1);
+
+	if (fd < 0) {
+		pperror("openat dir");
+		return 0;
+	}
+
+	path = fd_path(fd, dirs.key);
+
+	if (!path) {
+		pperror("dir path");
+		close(fd);
+		return 0;
+	}
+
+	dirs_evict(-1);
+	*dir = dirs_add(strdup(dirs.key), path, fd);
+
+	return slash + 1;
+}
+
+
+static FILE *
+fopenat(int dir, const char *name)
+{
+	int fd = openat(at(dir), name, O_RDONLY | O_CLOEXEC);
+
+	count(OPENS, 1);
+
+	return (fd < 0) ? 0 : fdopen(fd, "r");
+}
+
+
 #define TRACK_DELIM ':'
 
 #define INDENT_PER_LEVEL 2
@@ -303,63 +661,39 @@ track_truncate(size_t pos)
 
 
 static char *
-track_append(const char *dep)
+track_append(int dir, const char *dep)
 {
 	char *record, *dep_full, *ptr;
 
-	size_t record_len, track_engaged = track.used
-
-		+ 1			/* TRACK_DELIM */
-					/* dep's directory */
+	size_t record_len = 1		/* TRACK_DELIM */
+		+ strlen(dir_path(dir))	/* dep's directory */
 		+ 1			/* '/' */
-		+ sizeof draft_prefix	/* is to be reserved in order to have
-					enough free space to construct the
-					draft_full in really_update_dep() */
-		+ strlen(dep)		/* dep */
-		+ 1;			/* terminating '\0' */
-
+		+ strlen(dep);		/* dep */
 
-	/* store cwd in the track */
-
-	while (1) {
-		if (track.size > track_engaged) {
-			dep_full = getcwd(track.buf + track.used + 1,
-					     track.size - track_engaged);
 
-			if (dep_full)		/* getcwd successful */
-				break;
-		} else
-			errno = ERANGE;
-
-		do {
-			if (errno != ERANGE)
-				pperror("getcwd");
-			else if (track.size < (SIZE_MAX - PATH_MAX)) {
-				size_t new_size = track.size + PATH_MAX;
-				char  *new_buf = realloc(track.buf, new_size);
-
-				if (new_buf) {
-					track.size = new_size;
-					track.buf  = new_buf;
-					break;
-				}
-				pperror("realloc");
-			}
+	if (track.size - track.used <= record_len) {
+		size_t new_size = track.used + record_len + PATH_MAX;
+		char  *new_buf = realloc(track.buf, new_size);
 
-			msg("Failed to get cwd", dep);
+		if (!new_buf) {
+			pperror("realloc");
+			msg("Failed to track", dep);
 
 			wflag = 0;	/* suppress warning, ensure error */
 			return 0;
+		}
 
-		} while(0);
+		track.size = new_size;
+		track.buf  = new_buf;
 	}
 
 
 	/* construct the dep's record and join it with the track */
 
-	record = dep_full - 1;
+	record = track.buf + track.used;
+	dep_full = record + 1;
 	*record = TRACK_DELIM;
-	record_len = stpcpy(stpcpy(strchr(record, 0), "/"), dep) - record;
+	stpcpy(stpcpy(stpcpy(dep_full, dir_path(dir)), "/"), dep);
 	track.used += record_len;
 
 
@@ -419,6 +753,7 @@ datefd(int fd)
 {
 	struct stat st;
 
+	count(STATS, 1);
 	if (fstat(fd, &st))
 		st.st_ctime = 0;
 	datestat(&st);
@@ -426,9 +761,10 @@ datefd(int fd)
 
 
 static void
-datefile(const char *name, struct stat *st)
+datefile(int dir, const char *name, struct stat *st)
 {
-	if(stat(name, st))
+	count(STATS, 1);
+	if(fstatat(at(dir), name, st, 0))
 		st->st_ctime = 0;
 	datestat(st);
 }
@@ -455,109 +791,248 @@ date_build(const char *var)
 }
 
 
-static void
-rehash(char *dep, int redate)
-{
-	static const char hexdigit[] = "0123456789abcdef";
+/*
+	Hashes of the files are cached in the table shared by all the redo
+	processes and builds via mmap() of REDO_HASH_CACHE file. The entry
+	is found by the file's inode and is valid only if the file's size,
+	mtime and ctime are the same as those at the hashing time. Entries
+	are written without locking, the torn ones fail the checksum and
+	are simply missed.
+*/
 
-	struct sha256 ctx;
-	char buf[4096];
-	char *a;
-	unsigned char hash[HASH_LEN];
-	int i, fd = open(dep, O_RDONLY);
-	ssize_t r;
+typedef struct {
+	uint64_t	dev, ino, size, mtime, ctime;
+	unsigned char	hash[HASH_LEN];
+	uint64_t	sum;
+} hash_entry;
 
+#define HASH_CACHE_SLOTS	65536
+#define HASH_CACHE_WAYS		4
 
-	sha256_init(&ctx);
+static hash_entry *hash_cache;
 
-	while ((r = read(fd, buf, sizeof buf)) > 0) {
-		sha256_update(&ctx, buf, r);
-	}
 
-	sha256_sum(&ctx, hash);
+static uint64_t
+hash_entry_sum(const hash_entry *e)
+{
+	const unsigned char *p = (const unsigned char *) e;
+	uint64_t sum = 14695981039346656037u;
+	size_t i;
 
-	for (i = 0, a = hexhash; i < HASH_LEN; i++) {
-		*a++ = hexdigit[hash[i] / 16];
-		*a++ = hexdigit[hash[i] % 16];
-	}
+	for (i = 0; i < offsetof(hash_entry, sum); i++)
+		sum = (sum ^ p[i]) * 1099511628211u;
 
-	if (redate)
-		datefd(fd);
+	return sum;
+}
 
-	if (fd > 0)
-		close(fd);
+
+static void
+hash_entry_key(hash_entry *e, const struct stat *st)
+{
+	memset(e, 0, sizeof *e);
+	e->dev   = st->st_dev;
+	e->ino   = st->st_ino;
+	e->size  = st->st_size;
+	e->mtime = st->st_mtim.tv_sec * 1000000000u + st->st_mtim.tv_nsec;
+	e->ctime = st->st_ctim.tv_sec * 1000000000u + st->st_ctim.tv_nsec;
 }
 
 
-static char *
-file_chdir(int *fd, char *name)
+static void
+hash_cache_open(void)
 {
-	int fd_new;
-	char *slash = strrchr(name, '/');
+	static int tried;
 
+	char *name;
+	int fd;
+	size_t size = HASH_CACHE_SLOTS * sizeof (hash_entry);
+	struct stat st;
+	void *m;
 
-	if (!slash)
-		return name;
 
-	*slash = 0;
-	fd_new = openat(*fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
-	*slash = '/';
+	if (tried++)
+		return;
 
-	if (fd_new < 0) {
-		pperror("openat dir");
-		return 0;
-	}
+	name = getenv("REDO_HASH_CACHE");
+	if (!name || !*name)
+		return;
 
-	if (fchdir(fd_new) < 0) {
-		pperror("chdir");
-		return 0;
+	fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	count(OPENS, 1);
+	count(STATS, fd >= 0);
+
+	if ((fd < 0) || fstat(fd, &st) ||
+	    (((size_t) st.st_size != size) && ftruncate(fd, size))) {
+		pperror(name);
+		if (fd >= 0)
+			close(fd);
+		return;
 	}
 
-	*fd = fd_new;
+	m = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
 
-	return slash + 1;
+	if (m == MAP_FAILED)
+		pperror("mmap");
+	else
+		hash_cache = m;
 }
 
 
-#define SUFFIX_LEN	(sizeof recipe_suffix - 1)
+static hash_entry *
+hash_cache_slot(const hash_entry *key)
+{
+	return hash_cache + ((key->dev * 31 + key->ino) * HASH_CACHE_WAYS) %
+							HASH_CACHE_SLOTS;
+}
 
-#define reserve(space)	if (recipe_free < (space)) return 0;\
-			recipe_free -= (space)
 
-static char *
-find_recipe(char *dep, char *recipe_rel, size_t recipe_free, const char *slash)
+static int
+hash_cache_get(const struct stat *st, unsigned char *hash)
 {
-	char	*recipe = recipe_rel,
-		*end  = strchr(dep, 0),
-		*tail = end,
-		*ext, *shadow;
+	hash_entry key, e, *slot;
+	int i;
 
-	size_t recipe_size = (end - dep) + sizeof recipe_suffix;
+	hash_cache_open();
+	if (!hash_cache)
+		return 0;
 
+	hash_entry_key(&key, st);
+	slot = hash_cache_slot(&key);
 
-	/* rewind .do tail inside dependency name */
+	for (i = 0; i < HASH_CACHE_WAYS; i++) {
+		e = slot[i];
+		if ((memcmp(&e, &key, offsetof(hash_entry, hash)) == 0) &&
+		    (e.sum == hash_entry_sum(&e))) {
+			memcpy(hash, e.hash, HASH_LEN);
+			count(CACHED, 1);
+			return 1;
+		}
+	}
 
-	while (1) {
-		ext = tail - SUFFIX_LEN;
-		if ((ext < dep) || strncmp(ext, recipe_suffix, SUFFIX_LEN))
-			break;
+	return 0;
+}
 
-		/* if we are still here means the dep is a recipe */
 
-		if (!eflag)
-			return 0;
+static void
+hash_cache_put(const struct stat *st, const unsigned char *hash)
+{
+	hash_entry e, *slot;
+	int i;
 
-		tail = ext;
-	}
+	if (!hash_cache)
+		return;
 
-	shadow = strstr(dep, ".do.");
-	if (shadow == tail)
-		shadow = 0;
+	hash_entry_key(&e, st);
+	memcpy(e.hash, hash, HASH_LEN);
+	e.sum = hash_entry_sum(&e);
 
-	reserve(recipe_size);		/* initial recipe name size */
-	strcpy(end, recipe_suffix);
+	slot = hash_cache_slot(&e);
 
-/*
+	/* the same inode's way or the random one */
+
+	for (i = 0; (i < HASH_CACHE_WAYS) &&
+		    ((slot[i].dev != e.dev) || (slot[i].ino != e.ino)); i++);
+
+	slot[(i < HASH_CACHE_WAYS) ? i : rand() % HASH_CACHE_WAYS] = e;
+}
+
+
+static void
+rehash(int dir, char *dep, int redate)
+{
+	static const char hexdigit[] = "0123456789abcdef";
+
+	struct sha256 ctx;
+	char buf[4096];
+	char *a;
+	unsigned char hash[HASH_LEN];
+	int i, fd = openat(at(dir), dep, O_RDONLY | O_CLOEXEC);
+	ssize_t r;
+	struct stat st, st_after;
+
+
+	count(OPENS, 1);
+	count(STATS, fd >= 0);
+	if ((fd < 0) || fstat(fd, &st))
+		st.st_ctime = 0;
+
+	if (!st.st_ctime || !S_ISREG(st.st_mode) ||
+	    !hash_cache_get(&st, hash)) {
+		sha256_init(&ctx);
+
+		while ((r = read(fd, buf, sizeof buf)) > 0) {
+			sha256_update(&ctx, buf, r);
+			count(HASHED, r);
+		}
+
+		sha256_sum(&ctx, hash);
+
+		/* cache only if the file was not changed while hashed */
+
+		if (st.st_ctime && S_ISREG(st.st_mode) &&
+		    (count(STATS, 1), !fstat(fd, &st_after)) &&
+		    (st.st_size == st_after.st_size) &&
+		    (st.st_mtim.tv_sec == st_after.st_mtim.tv_sec) &&
+		    (st.st_mtim.tv_nsec == st_after.st_mtim.tv_nsec) &&
+		    (st.st_ctim.tv_sec == st_after.st_ctim.tv_sec) &&
+		    (st.st_ctim.tv_nsec == st_after.st_ctim.tv_nsec))
+			hash_cache_put(&st, hash);
+	}
+
+	for (i = 0, a = hexhash; i < HASH_LEN; i++) {
+		*a++ = hexdigit[hash[i] / 16];
+		*a++ = hexdigit[hash[i] % 16];
+	}
+
+	if (redate)
+		datestat(&st);
+
+	if (fd >= 0)
+		close(fd);
+}
+
+
+#define SUFFIX_LEN	(sizeof recipe_suffix - 1)
+
+#define reserve(space)	if (recipe_free < (space)) return 0;\
+			recipe_free -= (space)
+
+static char *
+find_recipe(int dir, char *dep, char *recipe_rel, size_t recipe_free,
+							const char *slash)
+{
+	char	*recipe = recipe_rel,
+		*end  = strchr(dep, 0),
+		*tail = end,
+		*ext, *shadow;
+
+	size_t recipe_size = (end - dep) + sizeof recipe_suffix;
+
+
+	/* rewind .do tail inside dependency name */
+
+	while (1) {
+		ext = tail - SUFFIX_LEN;
+		if ((ext < dep) || strncmp(ext, recipe_suffix, SUFFIX_LEN))
+			break;
+
+		/* if we are still here means the dep is a recipe */
+
+		if (!eflag)
+			return 0;
+
+		tail = ext;
+	}
+
+	shadow = strstr(dep, ".do.");
+	if (shadow == tail)
+		shadow = 0;
+
+	reserve(recipe_size);		/* initial recipe name size */
+	strcpy(end, recipe_suffix);
+
+/*
 	The full dependency name is used for recipe search only in the
 	current directory. The search in the updirs omits the first name.
 	Omitting increases the free space for recipe_rel and is done only
@@ -575,7 +1050,8 @@ find_recipe(char *dep, char *recipe_rel, size_t recipe_free, const char *slash)
 			if (fflag)
 				dprintf(1, "%s\n", recipe_rel);
 
-			if (access(recipe_rel, F_OK) == 0) {
+			count(ACCESSES, 1);
+			if (faccessat(at(dir), recipe_rel, F_OK, 0) == 0) {
 				*dep = '\0';
 				return recipe;
 			}
@@ -596,43 +1072,83 @@ find_recipe(char *dep, char *recipe_rel, size_t recipe_free, const char *slash)
 }
 
 
-enum errors {
-	OK	= 0,
-	ERROR	= 1,
-	BUSY	= EX_TEMPFAIL
+enum durabilities {
+	VOLATILE	= 0,	/* leave the writeback to the kernel */
+	COMMITTED	= 1,	/* fdatasync() every file before rename() */
+	BATCHED		= 2	/* syncfs() once at the end of the build */
 };
 
-#define ERRORS 0xff
 
+static int
+settle(int dir, const char *name)
+{
+	int err = OK, fd = openat(at(dir), name, O_RDONLY | O_CLOEXEC);
+
+	count(OPENS, 1);
+	if ((fd < 0) || fdatasync(fd)) {
+		pperror("fdatasync");
+		err = ERROR;
+	}
 
-enum hints {
-	IS_SOURCE		= 0x100,
-	UPDATED_RECENTLY	= 0x200,
-	IMMEDIATE_DEPENDENCY	= 0x400
-};
+	if (fd >= 0)
+		close(fd);
 
-#define HINTS (~ERRORS)
+	return err;
+}
+
+
+/* syncs the filesystem of the current directory, or all of them */
+
+static void
+settle_all(void)
+{
+#ifdef __linux__
+	if (syncfs(dirs.home) == 0)
+		return;
+#endif
+	sync();
+}
+
+
+/* remove() relative to dir */
+
+static int
+removeat(int dir, const char *name, struct stat *st)
+{
+	return unlinkat(at(dir), name, S_ISDIR(st->st_mode) ? AT_REMOVEDIR : 0);
+}
 
 
+#define lstatat(dir, name, st) \
+	(count(STATS, 1), fstatat(at(dir), name, st, AT_SYMLINK_NOFOLLOW))
+
 static int
-choose(const char *old, const char *new, int err)
+choose(int dir, const char *old, const char *new, int err)
 {
 	struct stat st;
 
 	if (err) {
-		if ((lstat(new, &st) == 0) && remove(new)) {
+		if ((lstatat(dir, new, &st) == 0) && removeat(dir, new, &st)) {
 			pperror("remove new");
 			err = ERROR;
 		}
 	} else {
-		if ((lstat(old, &st) == 0) && remove(old)) {
+		if ((durability == COMMITTED) &&
+		    (lstatat(dir, new, &st) == 0) && settle(dir, new))
+			return choose(dir, old, new, ERROR);
+		if ((lstatat(dir, old, &st) == 0) && removeat(dir, old, &st)) {
 			pperror("remove old");
 			err = ERROR;
 		}
-		if ((lstat(new, &st) == 0) && rename(new, old)) {
+		if ((lstatat(dir, new, &st) == 0) &&
+		    renameat(at(dir), new, at(dir), old)) {
 			pperror("rename");
 			err = ERROR;
 		}
+		if (!err && (durability == COMMITTED) && fsync(at(dir))) {
+			pperror("fsync dir");
+			err = ERROR;
+		}
 	}
 
 	return err;
@@ -652,626 +1168,3763 @@ process_times(void)
 
 #define NAME_MAX 255
 
-#define log_time(format) if (log_fd > 0)\
-	dprintf(log_fd, "%*s" format "\n", indent, "", process_times())
-
-static int
-run_recipe(int fd, char *recipe_rel, const char *target,
-				const char *family, size_t reldir_len)
-{
-	int err = ERROR;
-
-	pid_t pid;
 
-	char	reldir[PATH_MAX],
-		tmp[NAME_MAX + 1];
+#define SHORTEST	10
+#define SCALEUPS	6
+#define LONGEST		(SHORTEST << SCALEUPS)
 
+#define MS_PER_S	1000
+#define NS_PER_MS	1000000
 
-	log_time("             %ld, -- tdo");
-	log_guard(open_comment);
+static int
+nap(int night)
+{
+	int asleep = night + (rand() % night); /* ms */
+	struct timespec s, r;
 
-	memcpy(reldir, recipe_rel, reldir_len);
-	reldir[reldir_len] = '\0';
+	s.tv_sec  =  asleep / MS_PER_S;
+	s.tv_nsec = (asleep % MS_PER_S) * NS_PER_MS;
 
-	strcpy(stpcpy(tmp, tmp_prefix), target);
+	nanosleep(&s, &r);
 
-	pid = fork();
-	if (pid < 0)
-		perror("fork");
-	else if (pid == 0) {
+	return asleep;
+}
 
-		if (setenvint("REDO_FD", fd) ||
-		    setenv("REDO_TRACK", track_buf(), 1)) {
-			perror("setenv");
-			exit(ERROR);
-		}
 
-		if (access(recipe_rel, X_OK) != 0) /* executable? */
-			execl("/bin/sh", "/bin/sh",
-				tflag ? "-ex" : "-e", recipe_rel,
-				target, family, tmp, reldir, (char *)0);
-		else
-			execl(recipe_rel, recipe_rel,
-				target, family, tmp, reldir, (char *)0);
+static double
+sense(const char *name, const char *format)
+{
+	double level = 0;
+	FILE *f = fopen(name, "r");
 
-		perror("execl");
-		exit(ERROR);
-	} else {
-		if (wait(&err) < 0)
-			perror("wait");
-		else {
-			if (WCOREDUMP(err))
-				dprintf(2, "Core dumped.\n");
-			if (WIFEXITED(err)) {
-				err = WEXITSTATUS(err);
-			} else if (WIFSIGNALED(err)) {
-				err = WTERMSIG(err);
-				dprintf(2, "Terminated.\n");
-			} else if (WIFSTOPPED(err)) {
-				err = WSTOPSIG(err);
-				dprintf(2, "Stopped.\n");
-			}
-		}
+	if (f) {
+		if (fscanf(f, format, &level) != 1)
+			level = 0;
+		fclose(f);
 	}
 
-	log_guard(close_comment);
-
-	return choose(target, tmp, err);
+	return level;
 }
 
 
 static int
-read_record(char *buf, FILE *f, char *filename)
+overloaded(void)
 {
-	if(fgets(buf, RECORD_SIZE, f)) {
-		char *eol_ch = strchr(buf, '\n');
+	static const char *const stall[] = {
+		"/proc/pressure/cpu",
+		"/proc/pressure/memory",
+		"/proc/pressure/io"
+	};
 
-		if (eol_ch && ((eol_ch - buf) >= NAME_OFFSET)) {
-			*eol_ch = '\0';
-			return 1;
-		}
+	unsigned i;
 
-		msg("Warning! Truncated record found", filename);
+	if ((load_max > 0) && (sense("/proc/loadavg", "%lf") > load_max))
+		return 1;
+
+	if (pressure_max > 0) {
+		for (i = 0; i < sizeof stall / sizeof stall[0]; i++)
+			if (sense(stall[i], "some avg10=%lf") > pressure_max)
+				return 1;
 	}
 
 	return 0;
 }
 
 
-static int
-find_record(char *target_path)
+#define THROTTLE_NAPS 10
+
+/*
+	Hold the recipe launch while the host is overloaded. The wait is
+	bounded in order to guarantee the progress even if the load is
+	produced by somebody else.
+*/
+
+static void
+throttle(void)
 {
-	int err = ERROR;
+	int night = SHORTEST, naps = THROTTLE_NAPS;
 
-	char	*target = base_name(target_path),
-		journal[PATH_MAX + sizeof journal_prefix];
+	while (naps-- && overloaded()) {
+		count(THROTTLED, nap(night));
+		if (night < LONGEST)
+			night *= 2;
+	}
+}
 
-	size_t len = target - target_path;
 
-	FILE *journal_f;
+#define POOL_NAME_MAX 64
 
+#ifdef F_OFD_SETLK
+#define SLOT_SETLK F_OFD_SETLK
+#else
+#define SLOT_SETLK F_SETLK
+#endif
 
-	memcpy(journal, target_path, len);
-	strcpy(stpcpy(journal + len, journal_prefix), target);
+/*
+	The recipe "x.do" is the member of the pool, if "x.do.pool" file
+	containing the pool name and depth (e.g. "link 2") exists. The pool
+	slots are the lock files shared by all redo instances, so that no
+	more than depth recipes of the same pool run simultaneously. If all
+	the slots are taken then the target is BUSY and will be retried, but
+	such pass does not count against REDO_RETRIES (see pool_full), the
+	pool is waited for as long as it takes. The slots are kept in the
+	private directory of the user unless REDO_POOL_DIR is set, the slot
+	of the shared directory which can not be opened is skipped.
+
+	The pools held by the ancestors are listed in REDO_POOLS as
+	"/name/name/". The nested recipe of such pool runs in its ancestor's
+	slot, otherwise it would wait for the slot its ancestor waits for it
+	to release.
+*/
 
-	journal_f = fopen(journal, "r");
+static char pool_held[POOL_NAME_MAX + 1];
 
-	if (journal_f) {
-		while (read_record(record_buf, journal_f, journal)) {
-			if (strcmp(target, namebuf) == 0) {
-				err = OK;
-				break;
-			}
-		}
+static int pool_full;
 
-		fclose(journal_f);
-	}
+static int
+pools_env(void)
+{
+	char *held = getenv("REDO_POOLS"), *s;
 
-	return err;
-}
+	if (!held)
+		held = "/";
 
+	s = malloc(strlen(held) + strlen(pool_held) + 2);
+	if (!s)
+		return -1;
+	sprintf(s, "%s%s/", held, pool_held);
 
-#define may_need_rehash(dep, hint) \
-(\
-	(hint & IS_SOURCE) ||\
-	(\
-		!(hint & UPDATED_RECENTLY) &&\
-		(find_record(dep) != OK)\
-	)\
-)
+	return setenv("REDO_POOLS", s, 1);
+}
 
 
 static int
-dep_changed(char *record, int hint)
+pool_enter(int dir, const char *recipe_rel, int *slot_fd)
 {
-	char	*filename = record + NAME_OFFSET,
-		*filedate = record + DATE_OFFSET;
+	char	pool[PATH_MAX], name[POOL_NAME_MAX + 1],
+		nested[POOL_NAME_MAX + 3],
+		*slots = getenv("REDO_POOL_DIR"),
+		*held = getenv("REDO_POOLS");
 
-	struct stat st;
-	int missing = may_need_rehash(filename, hint);
+	char	own[sizeof P_tmpdir "/redo-pools." + 3 * sizeof(uid_t)];
 
+	int depth, slot, taken = 0;
 
-	if (missing)
-		datefile(filename, &st);
+	FILE *f;
 
-	if (strncmp(filedate, hexdate, HEXDATE_LEN) == 0) {
-/*
-		Dependency date matching its journal record date means
-		that dependency was not modified and the hash from its
-		journal record can be forwarded to the global buffer
-		to be used by write_dep().
-*/
-		memcpy(hexhash, record, HEXHASH_LEN);
-		return 0;
-	}
+	struct stat st;
 
-	if (missing)
-		rehash(filename, 0);
+	struct flock fl = {
+		.l_type	  = F_WRLCK,
+		.l_whence = SEEK_SET
+	};
 
-	return strncmp(record, hexhash, HEXHASH_LEN);
-}
 
+	*slot_fd = -1;
 
-static int
-write_dep(int fd, char *dep, int hint)
-{
-	if (may_need_rehash(dep, hint))
-		rehash(dep, 1);
+	if (snprintf(pool, sizeof pool, "%s%s", recipe_rel, pool_suffix)
+							>= (int) sizeof pool)
+		return OK;
 
-	hexhash[HEXHASH_LEN] = '\0';
-	hexdate[HEXDATE_LEN] = '\0';
+	f = fopenat(dir, pool);
+	if (!f)
+		return OK;
 
-	if (dprintf(fd, "%s %s %s\n", hexhash, hexdate, dep) < 0) {
-		pperror("dprintf");
+	depth = fscanf(f, "%" stringize(POOL_NAME_MAX) "s %d", name, &depth)
+							== 2 ? depth : 0;
+	fclose(f);
+
+	if ((depth <= 0) || strchr(name, '/')) {
+		msg("Bad pool", pool);
 		return ERROR;
 	}
 
-	return OK;
-}
+	sprintf(nested, "/%s/", name);
+	if (held && strstr(held, nested))
+		return OK;	/* in the ancestor's slot */
 
+	if (!slots) {
+		slots = own;
+		sprintf(own, "%s/redo-pools.%ld", P_tmpdir, (long) getuid());
+		if (mkdir(own, 0700) && (errno != EEXIST)) {
+			pperror(own);
+			return ERROR;
+		}
+		count(STATS, 1);
+		if (lstat(own, &st) || !S_ISDIR(st.st_mode) ||
+		    (st.st_uid != getuid())) {
+			msg("Pool directory not owned", own);
+			return ERROR;
+		}
+	}
 
-static int really_update_dep(int dir_fd, char *dep);
+	for (slot = 0; slot < depth; slot++) {
+		snprintf(pool, sizeof pool, "%s/%s%s.%d",
+					slots, pool_prefix, name, slot);
 
-static int
-update_dep(int dir_fd, char *dep_path, int *hint)
-{
-	int dep_dir_fd = dir_fd, err = ERROR;
+		*slot_fd = open(pool, O_CREAT | O_RDWR | O_CLOEXEC, 0666);
+		count(OPENS, 1);
+		if ((*slot_fd < 0) && (errno == EACCES))
+			continue;	/* another user's slot */
+		if (*slot_fd < 0) {
+			pperror("open pool slot");
+			return ERROR;
+		}
 
+		if (slots != own)
+			fchmod(*slot_fd, 0666);	/* for the other users */
 
-	if (strchr(dep_path, TRACK_DELIM))
-		msg("Illegal symbol "stringize(TRACK_DELIM), dep_path);
-	else {
-		char *dep = file_chdir(&dep_dir_fd, dep_path);
+		if (fcntl(*slot_fd, SLOT_SETLK, &fl) == 0) {
+			strcpy(pool_held, name);
+			return OK;
+		}
 
-		if (!dep)
-			msg("Missing dependency directory", dep_path);
-		else if (strlen(dep) > (NAME_MAX + 1 - sizeof tmp_prefix))
-			msg("Dependency name too long", dep);
-		else {
-			size_t cutoff = track_used();
+		close(*slot_fd);
+		*slot_fd = -1;
 
-			indent += INDENT_PER_LEVEL;
-			err = really_update_dep(dep_dir_fd, dep);
-			indent -= INDENT_PER_LEVEL;
-			track_truncate(cutoff);
+		if ((errno != EACCES) && (errno != EAGAIN)) {
+			pperror("lock pool slot");
+			return ERROR;
 		}
+		taken++;
+	}
 
-		if (dir_fd != dep_dir_fd) {
-			if (fchdir(dir_fd) < 0) {
-				pperror("chdir back");
+	if (!taken) {
+		msg("No pool slot accessible", name);
+		return ERROR;
+	}
+
+	pool_full = 1;
+
+	return BUSY;
+}
+
+
+/*
+	With REDO_CANCEL the first failure stops the whole build. The
+	topmost redo shares the empty flag file with all the instances via
+	REDO_CANCEL_FD, the failing one makes it non-empty. Since then no
+	recipe is launched, the targets are BUSY and every instance returns
+	ERROR. With REDO_CANCEL=2 the recipes of the topmost redo run in
+	their own process groups, which are terminated on the flag as well.
+*/
+
+#define CANCEL_POLL_USEC 100000
+
+static int cancel_mode, cancel_fd = -1, cancel_owner;
+
+static volatile sig_atomic_t terminated;
+
+/* SIGTERM is raised again by main() after the cleanup */
+
+static void
+interrupt(int sig)
+{
+	if (sig == SIGTERM)
+		terminated = 1;
+}
+
+
+static int
+cancelled(void)
+{
+	struct stat st;
+
+	return terminated || ((cancel_fd >= 0) &&
+		(count(STATS, 1), !fstat(cancel_fd, &st)) && st.st_size);
+}
+
+
+static void
+cancel(void)
+{
+	if ((cancel_fd >= 0) && (pwrite(cancel_fd, "!", 1, 0) < 0))
+		pperror("cancel");
+}
+
+
+static void
+cancel_poll(int on)
+{
+	struct itimerval it = {
+		.it_interval.tv_usec = on ? CANCEL_POLL_USEC : 0,
+		.it_value.tv_usec    = on ? CANCEL_POLL_USEC : 0
+	};
+
+	setitimer(ITIMER_REAL, &it, 0);
+}
+
+
+#define log_time(format) if (log_fd > 0)\
+	dprintf(log_fd, "%*s" format "\n", indent, "", process_times())
+
+
+/*
+	The resources used by the recipe and all its descendants, as
+	reported by wait4(). Times are in seconds, maxrss is the peak of
+	the largest process in KiB, blocks are 512-byte ones.
+*/
+
+static double
+seconds(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+
+static double
+elapsed(const struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+
+static void
+log_usage(double wall, const struct rusage *ru)
+{
+	dprintf(log_fd, "%*s     usage = { wall = %.6f, utime = %.6f, "
+		"stime = %.6f, maxrss = %ld,\n"
+		"%*s               inblock = %ld, oublock = %ld, "
+		"nvcsw = %ld, nivcsw = %ld },\n",
+		indent, "", wall,
+		seconds(&ru->ru_utime), seconds(&ru->ru_stime), ru->ru_maxrss,
+		indent, "", ru->ru_inblock, ru->ru_oublock,
+		ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+
+/*
+	With REDO_AUTODEP set to the path of the shim library (see
+	samples/autodep) the recipe is run with the shim preloaded. The
+	shim appends the files opened by the recipe to the log named by
+	REDO_AUTODEP_LOG, and they are recorded as the dependencies after
+	the recipe succeeded, just as if the recipe called depends-on.
+*/
+
+static char *autodep, autodep_log[sizeof P_tmpdir "/redo-autodep.XXXXXX"];
+
+static int
+autodep_env(void)
+{
+	char *preload = getenv("LD_PRELOAD"), *s = autodep;
+
+	if (preload && *preload) {
+		s = malloc(strlen(autodep) + strlen(preload) + 2);
+		if (!s)
+			return -1;
+		sprintf(s, "%s:%s", autodep, preload);
+	}
+
+	return	setenv("REDO_AUTODEP_LOG", autodep_log, 1) ||
+		setenv("LD_PRELOAD", s, 1);
+}
+
+
+static void
+autodep_open(void)
+{
+	int fd;
+
+	strcpy(autodep_log, P_tmpdir "/redo-autodep.XXXXXX");
+
+	fd = mkstemp(autodep_log);
+	if (fd < 0) {
+		pperror("autodep log");
+		*autodep_log = '\0';
+	} else
+		close(fd);
+}
+
+
+/*
+	The recipe may build the sibling outputs besides $3, declaring them
+	with "depends-on -o name ...". The names are appended to the file
+	named by REDO_OUTPUTS, see outputs_commit().
+*/
+
+static char outputs[sizeof P_tmpdir "/redo-outputs.XXXXXX"];
+
+static void
+outputs_open(void)
+{
+	int fd;
+
+	strcpy(outputs, P_tmpdir "/redo-outputs.XXXXXX");
+
+	fd = mkstemp(outputs);
+	if (fd < 0) {
+		pperror("outputs");
+		*outputs = '\0';
+	} else
+		close(fd);
+}
+
+
+static int
+fork_recipe(int dir, int fd, const char *recipe_rel, const char *target,
+		const char *family, const char *tmp, const char *reldir,
+		struct rusage *ru)
+{
+	int err = ERROR, killer = cancel_owner && (cancel_mode > 1),
+	    killed = 0, w;
+
+	pid_t pid = fork();
+
+
+	if (pid < 0)
+		perror("fork");
+	else if (pid == 0) {
+
+		if (killer)
+			setpgid(0, 0);
+
+		if (setenvint("REDO_FD", fd) ||
+		    setenv("REDO_TRACK", track_buf(), 1) ||
+		    (*pool_held && pools_env()) ||
+		    (*outputs ? setenv("REDO_OUTPUTS", outputs, 1) :
+				unsetenv("REDO_OUTPUTS")) ||
+		    (*autodep_log && autodep_env())) {
+			perror("setenv");
+			exit(ERROR);
+		}
+
+		if (fchdir(at(dir)) < 0) {
+			perror("chdir");
+			exit(ERROR);
+		}
+
+		if (access(recipe_rel, X_OK) != 0) /* executable? */
+			execl("/bin/sh", "/bin/sh",
+				tflag ? "-ex" : "-e", recipe_rel,
+				target, family, tmp, reldir, (char *)0);
+		else
+			execl(recipe_rel, recipe_rel,
+				target, family, tmp, reldir, (char *)0);
+
+		perror("execl");
+		exit(ERROR);
+	} else {
+		if (killer) {
+			setpgid(pid, pid);
+			cancel_poll(1);
+		}
+
+		while (((w = wait4(pid, &err, 0, ru)) < 0) && (errno == EINTR))
+			if (killer && !killed && cancelled())
+				killed = !kill(-pid, SIGTERM);
+
+		if (killer)
+			cancel_poll(0);
+
+		if (w < 0)
+			perror("wait");
+		else {
+			if (WCOREDUMP(err))
+				dprintf(2, "Core dumped.\n");
+			if (WIFEXITED(err)) {
+				err = WEXITSTATUS(err);
+			} else if (WIFSIGNALED(err)) {
+				err = WTERMSIG(err);
+				dprintf(2, "Terminated.\n");
+			} else if (WIFSTOPPED(err)) {
+				err = WSTOPSIG(err);
+				dprintf(2, "Stopped.\n");
+			}
+		}
+	}
+
+	return err;
+}
+
+
+/*
+	REDO_TIMES names the file keeping the wall time of the recipes,
+	"seconds whole-name" lines appended by all the instances after the
+	successful runs. The latest line of the name wins. The file is
+	compacted on load if it has grown too much. The times give the
+	progress its ETA.
+*/
+
+typedef struct {
+	char	*name;
+	double	wall;
+} lap;
+
+static struct {
+	lap	*slot;
+	int	num, size, lines;
+	char	*file;
+} laps;
+
+
+static int
+laps_find(const char *name)
+{
+	int i = dirs_hash(name) & (laps.size - 1);
+
+	while (laps.slot[i].name && strcmp(laps.slot[i].name, name))
+		i = (i + 1) & (laps.size - 1);
+
+	return i;
+}
+
+
+static double
+laps_get(const char *name)
+{
+	return laps.size ? laps.slot[laps_find(name)].wall : 0;
+}
+
+
+static void
+laps_put(const char *name, double wall)
+{
+	lap *slot = laps.slot;
+	int i, size = laps.size;
+
+	if (2 * (laps.num + 1) > laps.size) {
+		laps.size = size ? 2 * size : 1024;
+		laps.slot = calloc(laps.size, sizeof (lap));
+		if (!laps.slot) {
+			laps.size = 0;
+			return;
+		}
+		for (i = 0; i < size; i++)
+			if (slot[i].name)
+				laps.slot[laps_find(slot[i].name)] = slot[i];
+		free(slot);
+	}
+
+	i = laps_find(name);
+	if (!laps.slot[i].name && (laps.slot[i].name = strdup(name)))
+		laps.num++;
+	laps.slot[i].wall = wall;
+}
+
+
+static void
+laps_load(void)
+{
+	char	line[PATH_MAX + 32], tmp[PATH_MAX], *name;
+
+	double	wall;
+
+	int	i;
+
+	FILE	*f;
+
+
+	if (!laps.file || !(f = fopen(laps.file, "r")))
+		return;
+
+	while (fgets(line, sizeof line, f)) {
+		line[strcspn(line, "\n")] = '\0';
+		wall = strtod(line, &name);
+		if (*name++ == ' ') {
+			laps_put(name, wall);
+			laps.lines++;
+		}
+	}
+	fclose(f);
+
+	if ((laps.lines < 2 * laps.num + 1024) ||
+	    (snprintf(tmp, sizeof tmp, "%s.%d", laps.file, getpid())
+							>= (int) sizeof tmp) ||
+	    !(f = fopen(tmp, "w")))
+		return;
+
+	for (i = 0; i < laps.size; i++)
+		if (laps.slot[i].name)
+			fprintf(f, "%.3f %s\n", laps.slot[i].wall,
+							laps.slot[i].name);
+
+	if (fclose(f) || rename(tmp, laps.file))
+		unlink(tmp);
+}
+
+
+static void
+laps_note(int dir, const char *target, double wall)
+{
+	int fd = open(laps.file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+									0666);
+
+	if (fd < 0)
+		return;
+
+	dprintf(fd, "%.3f %s/%s\n", wall, dir_path(dir), target);
+	close(fd);
+}
+
+
+static void progress_running(int dir, const char *target);
+
+static char *worker;
+
+static int verify_jobs, verifying;
+
+static int dispatch(int dir, int fd, char *recipe_rel, const char *target,
+		const char *family, const char *tmp, const char *reldir);
+
+static int autodep_collect(int dir, int fd, const char *recipe_rel,
+							const char *target);
+
+static int outputs_commit(int dir, const char *target, int err);
+
+static int
+run_recipe(int dir, int fd, char *recipe_rel, const char *target,
+				const char *family, size_t reldir_len)
+{
+	int slot_fd, err;
+
+	char	reldir[PATH_MAX],
+		tmp[NAME_MAX + 1],
+		recipe[PATH_MAX],
+		name[NAME_MAX + 1],
+		stem[NAME_MAX + 1];
+
+	struct timespec t0;
+
+	struct rusage ru = {0};
+
+
+	if (verifying)
+		return BUSY;
+
+	throttle();
+
+	if (cancelled())
+		return BUSY;
+
+	err = pool_enter(dir, recipe_rel, &slot_fd);
+	if (err)
+		return err;
+
+	count(RECIPES, 1);
+	log_time("             %ld, -- tdo");
+	log_guard(open_comment);
+
+	memcpy(reldir, recipe_rel, reldir_len);
+	reldir[reldir_len] = '\0';
+
+	/* update_dep() of the remote rounds and autodeps may move names.buf */
+	recipe_rel = strcpy(recipe, recipe_rel);
+	target = strcpy(name, target);
+	family = strcpy(stem, family);
+
+	strcpy(stpcpy(tmp, tmp_prefix), target);
+
+	progress_running(dir, target);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	err = worker ? dispatch(dir, fd, recipe_rel, target,
+						family, tmp, reldir) : -1;
+	if (err < 0) {
+		if (autodep)
+			autodep_open();
+		outputs_open();
+		err = fork_recipe(dir, fd, recipe_rel, target,
+					family, tmp, reldir, &ru);
+		log_guard(close_comment);
+		if (log_fd > 0)
+			log_usage(elapsed(&t0), &ru);
+		if (*autodep_log) {
+			if (!err)
+				err = autodep_collect(dir, fd, recipe_rel,
+								target);
+			unlink(autodep_log);
+			*autodep_log = '\0';
+		}
+	} else
+		log_guard(close_comment);
+
+	dirs_drop();
+
+	if (!err && laps.file)
+		laps_note(dir, target, elapsed(&t0));
+
+	progress_running(dir, 0);
+
+	if (slot_fd >= 0)
+		close(slot_fd);
+	*pool_held = '\0';
+
+	err = choose(dir, target, tmp, err);
+
+	return *outputs ? outputs_commit(dir, target, err) : err;
+}
+
+
+static int
+read_record(char *buf, FILE *f, char *filename)
+{
+	if(fgets(buf, RECORD_SIZE, f)) {
+		char *eol_ch = strchr(buf, '\n');
+
+		count(RECORDS, 1);
+
+		if (eol_ch && ((eol_ch - buf) >= NAME_OFFSET)) {
+			*eol_ch = '\0';
+			return 1;
+		}
+
+		msg("Warning! Truncated record found", filename);
+	}
+
+	return 0;
+}
+
+
+static int
+find_record(int dir, char *target_path)
+{
+	int err = ERROR;
+
+	char	*target = base_name(target_path),
+		journal[PATH_MAX + sizeof journal_prefix];
+
+	size_t len = target - target_path;
+
+	FILE *journal_f;
+
+
+	memcpy(journal, target_path, len);
+	strcpy(stpcpy(journal + len, journal_prefix), target);
+
+	journal_f = fopenat(dir, journal);
+
+	if (journal_f) {
+		count(JOURNALS, 1);
+		while (read_record(record_buf, journal_f, journal)) {
+			if (strcmp(target, namebuf) == 0) {
+				err = OK;
+				break;
+			}
+		}
+
+		fclose(journal_f);
+	}
+
+	return err;
+}
+
+
+/*
+	Reads all the journal's records at once as '\0'-separated strings
+	and rewinds the journal for the sequential verification.
+*/
+
+static char *
+journal_list(FILE *f, int *num)
+{
+	char record[RECORD_SIZE], *eol;
+	buffer list = {0};
+
+	for (*num = 0; fgets(record, sizeof record, f); (*num)++) {
+		eol = strchr(record, '\n');
+		if (!eol || ((eol - record) < NAME_OFFSET) ||
+		    buffer_add(&list, record, eol - record + 1))
+			break;
+		list.buf[list.used - 1] = '\0';
+	}
+
+	rewind(f);
+
+	return list.buf;
+}
+
+
+/*
+	If REDO_PREFETCH=1 then statx() of all the dependencies listed in
+	the journal are submitted to io_uring at once when the journal is
+	opened, and dep_changed() takes the dates of the sources from the
+	completions instead of stat()-ing them one by one. The targets are
+	stat()-ed as usual, because they may be rebuilt in the meantime.
+	Without io_uring the prefetch is silently omitted. IORING_OP_STATX
+	is the enum constant, so the headers are checked for the feature
+	flag of the same kernel release (5.6) instead.
+*/
+
+typedef struct prefetch prefetch;
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+    defined(IORING_FEAT_SINGLE_MMAP) && defined(IORING_FEAT_RW_CUR_POS) && \
+    defined(STATX_CTIME)
+
+typedef struct {
+	struct statx	stx;
+	prefetch	*batch;
+	int		res, done;
+} glance;
+
+struct prefetch {
+	int	dirfd, num, pending, next;
+	char	*records,	/* '\0'-separated, in the journal order */
+		*cursor;	/* the next one */
+	glance	glances[];
+};
+
+#define URING_ENTRIES 256
+
+static struct {
+	int		fd, inflight;
+	unsigned	*sq_head, *sq_tail, *sq_mask, *sq_array,
+			*cq_head, *cq_tail, *cq_mask, cq_entries;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+} uring = { .fd = -1 };
+
+static int prefetching;
+
+
+static int
+uring_init(void)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	char *sq, *cq;
+	int fd;
+
+	memset(&p, 0, sizeof p);
+	fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (fd < 0)
+		return -1;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = MAX(sq_size, cq_size);
+
+#define URING_MAP(size, off) mmap(0, size, PROT_READ | PROT_WRITE,\
+					MAP_SHARED | MAP_POPULATE, fd, off)
+
+	sq = URING_MAP(sq_size, IORING_OFF_SQ_RING);
+	cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq :
+		URING_MAP(cq_size, IORING_OFF_CQ_RING);
+	uring.sqes = URING_MAP(p.sq_entries * sizeof (struct io_uring_sqe),
+							IORING_OFF_SQES);
+
+	if ((sq == MAP_FAILED) || (cq == MAP_FAILED) ||
+	    (uring.sqes == MAP_FAILED)) {
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	uring.sq_head  = (unsigned *) (sq + p.sq_off.head);
+	uring.sq_tail  = (unsigned *) (sq + p.sq_off.tail);
+	uring.sq_mask  = (unsigned *) (sq + p.sq_off.ring_mask);
+	uring.sq_array = (unsigned *) (sq + p.sq_off.array);
+	uring.cq_head  = (unsigned *) (cq + p.cq_off.head);
+	uring.cq_tail  = (unsigned *) (cq + p.cq_off.tail);
+	uring.cq_mask  = (unsigned *) (cq + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	uring.cq_entries = p.cq_entries;
+	uring.fd = fd;
+
+	return fd;
+}
+
+
+static void
+uring_reap(int wait)
+{
+	unsigned head = *uring.cq_head;
+
+	if (wait && (head == __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)))
+		syscall(__NR_io_uring_enter, uring.fd, 0, 1,
+					IORING_ENTER_GETEVENTS, 0, 0);
+
+	for ( ; head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+								head++) {
+		struct io_uring_cqe *cqe = uring.cqes + (head & *uring.cq_mask);
+		glance *g = (glance *) (uintptr_t) cqe->user_data;
+
+		g->res = cqe->res;
+		g->done = 1;
+		g->batch->pending--;
+		uring.inflight--;
+	}
+
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+static prefetch *
+prefetch_open(int dir, FILE *journal_f)
+{
+	char *record;
+	unsigned tail, i;
+	int num, r;
+	prefetch *p;
+
+
+	if (!prefetching || ((uring.fd < 0) && (uring_init() < 0))) {
+		prefetching = 0;
+		return 0;
+	}
+
+	record = journal_list(journal_f, &num);
+
+	if ((unsigned) num > uring.cq_entries - uring.inflight)
+		num = uring.cq_entries - uring.inflight;
+	if (num > URING_ENTRIES)
+		num = URING_ENTRIES;
+
+	p = malloc(sizeof *p + num * sizeof (glance));
+	if (!p || !record) {
+		free(record);
+		free(p);
+		return 0;
+	}
+
+	p->records = p->cursor = record;
+	p->dirfd = fcntl(at(dir), F_DUPFD_CLOEXEC, 0);
+	if (p->dirfd < 0) {
+		free(p->records);
+		free(p);
+		return 0;
+	}
+
+	p->num = p->pending = p->next = 0;
+	tail = *uring.sq_tail;
+
+	for ( ; p->num < num; record = strchr(record, '\0') + 1) {
+		struct io_uring_sqe *sqe = uring.sqes + (tail & *uring.sq_mask);
+		glance *g = p->glances + p->num;
+
+		g->batch = p;
+		g->done = 0;
+
+		memset(sqe, 0, sizeof *sqe);
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = p->dirfd;
+		sqe->addr = (uintptr_t) (record + NAME_OFFSET);
+		sqe->len = STATX_CTIME;
+		sqe->off = (uintptr_t) &g->stx;
+		sqe->user_data = (uintptr_t) g;
+
+		uring.sq_array[tail & *uring.sq_mask] = tail & *uring.sq_mask;
+		tail++;
+
+		p->num++;
+	}
+
+	__atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);
+
+	for (i = 0; i < (unsigned) p->num; i += r) {
+		r = syscall(__NR_io_uring_enter, uring.fd, p->num - i,
+								0, 0, 0, 0);
+		if (r <= 0)
+			break;
+	}
+
+	if (i < (unsigned) p->num) {	/* withdraw the unsubmitted ones */
+		__atomic_store_n(uring.sq_tail, tail - (p->num - i),
+							__ATOMIC_RELEASE);
+		p->num = i;
+	}
+
+	p->pending = p->num;
+	uring.inflight += p->num;
+	count(STATS, p->num);
+
+	return p;
+}
+
+
+/*
+	Sets hexdate of the name if it was prefetched, returns 1 on success.
+	The names are looked for in the journal order.
+*/
+
+static int
+prefetched(prefetch *p, const char *name)
+{
+	char *s = p->cursor;
+	struct stat st;
+	int i;
+
+	for (i = p->next; (i < p->num) && strcmp(s + NAME_OFFSET, name); i++)
+		s = strchr(s, '\0') + 1;
+
+	if (i >= p->num)
+		return 0;
+
+	p->next = i + 1;
+	p->cursor = strchr(s, '\0') + 1;
+
+	while (!p->glances[i].done)
+		uring_reap(1);
+
+	st.st_ctime = (p->glances[i].res < 0) ? 0 :
+				p->glances[i].stx.stx_ctime.tv_sec;
+	datestat(&st);
+
+	return 1;
+}
+
+
+static void
+prefetch_close(prefetch *p)
+{
+	if (!p)
+		return;
+
+	while (p->pending)
+		uring_reap(1);
+
+	close(p->dirfd);
+	free(p->records);
+	free(p);
+}
+
+#else
+
+static int prefetching;
+
+#define prefetch_open(dir, journal_f)	((void) (dir), (void) (journal_f), \
+						(prefetch *) 0)
+#define prefetched(p, name)		0
+#define prefetch_close(p)		((void) (p))
+
+#endif
+
+
+#define may_need_rehash(dir, dep, hint) \
+(\
+	(hint & IS_SOURCE) ||\
+	(\
+		!(hint & UPDATED_RECENTLY) &&\
+		(find_record(dir, dep) != OK)\
+	)\
+)
+
+
+static int
+dep_changed(int dir, char *record, int hint, prefetch *p)
+{
+	char	*filename = record + NAME_OFFSET,
+		*filedate = record + DATE_OFFSET;
+
+	struct stat st;
+	int missing = may_need_rehash(dir, filename, hint);
+
+
+	if (missing && !(p && (hint & IS_SOURCE) && prefetched(p, filename)))
+		datefile(dir, filename, &st);
+
+	if (strncmp(filedate, hexdate, HEXDATE_LEN) == 0) {
+/*
+		Dependency date matching its journal record date means
+		that dependency was not modified and the hash from its
+		journal record can be forwarded to the global buffer
+		to be used by write_dep().
+*/
+		memcpy(hexhash, record, HEXHASH_LEN);
+		return 0;
+	}
+
+	if (missing)
+		rehash(dir, filename, 0);
+
+	return strncmp(record, hexhash, HEXHASH_LEN);
+}
+
+
+/*
+	Records are collected in the records buffer and reach the draft
+	with the single write() per journal. Nested frames of the walk
+	use the buffer as a stack, appending their records after the
+	parent's pending ones and flushing them before ascend.
+*/
+
+static int
+write_dep(int dir, char *dep, int hint)
+{
+	size_t dep_len = strlen(dep), record_len = NAME_OFFSET + dep_len + 1;
+
+	if (may_need_rehash(dir, dep, hint))
+		rehash(dir, dep, 1);
+
+	if (records.size - records.used < record_len) {
+		size_t new_size = records.size + record_len + RECORD_SIZE;
+		char  *new_buf = realloc(records.buf, new_size);
+
+		if (!new_buf) {
+			pperror("realloc");
+			return ERROR;
+		}
+		records.size = new_size;
+		records.buf  = new_buf;
+	}
+
+	hexhash[HEXHASH_LEN] = ' ';
+	hexdate[HEXDATE_LEN] = ' ';
+
+	memcpy(records.buf + records.used, record_buf, NAME_OFFSET);
+	memcpy(records.buf + records.used + NAME_OFFSET, dep, dep_len);
+	records.used += record_len;
+	records.buf[records.used - 1] = '\n';
+
+	return OK;
+}
+
+
+static int
+flush_deps(int fd, size_t pos)
+{
+	char *buf = records.buf + pos;
+	size_t len = records.used - pos;
+	ssize_t w;
+
+	records.used = pos;
+
+	for ( ; len ; buf += w, len -= w) {
+		w = write(fd, buf, len);
+		if (w < 0) {
+			if (errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			pperror("write");
+			return ERROR;
+		}
+	}
+
+	return OK;
+}
+
+
+#define log_name() if (log_fd > 0)\
+	dprintf(log_fd, "%*s\"%s\",\n", indent, "", whole);
+
+#define log_err() if (log_fd > 0)\
+	dprintf(log_fd, "%*s{ err = %d },\n", indent, "", err)
+
+#define log_close_level() if (log_fd > 0)\
+	dprintf(log_fd, "%*s        t1 = %ld, err = %d\n%*s},\n",\
+			indent, "", process_times(), err, indent, "")
+
+
+#define CR_WR_TR (O_CREAT | O_WRONLY | O_TRUNC)
+
+
+#ifdef F_OFD_SETLK
+
+/*
+	The draft is the lock. It is held as the open file description
+	lock, released by the kernel together with the last descriptor,
+	even if the owner was killed. So the draft left by the dead owner
+	is taken over and truncated, while the live owner makes the draft
+	busy. The draft may be renamed or removed by its owner between
+	open() and fcntl(), such orphaned inode is abandoned.
+*/
+
+static int
+draft_open(int dir, const char *draft)
+{
+	struct flock fl = {
+		.l_type	  = F_WRLCK,
+		.l_whence = SEEK_SET
+	};
+
+	struct stat fd_st, name_st;
+
+	int fd;
+
+
+	while (1) {
+		fd = openat(at(dir), draft, O_CREAT | O_WRONLY, 0666);
+		count(OPENS, 1);
+		if (fd < 0)
+			return fd;
+
+		if (fcntl(fd, F_OFD_SETLK, &fl)) {
+			if ((errno == EAGAIN) || (errno == EACCES))
+				errno = EEXIST;
+			close(fd);
+			return -1;
+		}
+
+		count(STATS, 1);
+		if (fstat(fd, &fd_st) == 0) {
+			count(STATS, 1);
+			if ((fstatat(at(dir), draft, &name_st, 0) == 0) &&
+			    (fd_st.st_ino == name_st.st_ino) &&
+			    (fd_st.st_dev == name_st.st_dev))
+				break;
+		}
+
+		close(fd);
+	}
+
+	if (fd_st.st_size && ftruncate(fd, 0)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+#else
+
+static int
+draft_open(int dir, const char *draft)
+{
+	count(OPENS, 1);
+
+	return openat(at(dir), draft, O_CREAT | O_WRONLY | O_EXCL, 0666);
+}
+
+#endif
+
+/*
+	The graph is walked with the explicit stack of frames instead of
+	the recursion, one frame per target being updated. The names of
+	the frame (dependency, recipe, journal, draft and the current
+	journal record) are kept in the names arena, which is the stack
+	too. The nested frame's name resides in its parent's names, so the
+	names are referred by offsets and survive the arena relocation.
+*/
+
+enum steps {
+	START,		/* find the recipe, check the journal, lock the draft */
+	VERIFY,		/* read the next journal record */
+	COMPARE,	/* the record's dependency is updated, compare it */
+	RECIPE,		/* the journal is over, update the new recipe */
+	BUILD		/* run the recipe if needed and commit */
+};
+
+typedef struct {
+	int	step, dir, err, hint, draft_fd,
+		new_recipe, up_to_date, journaled, sibling, stale, failed;
+
+	mode_t	journal_mode;
+
+	FILE	*journal_f;
+
+	prefetch *prefetch;
+
+	size_t	cutoff, whole_pos, records_pos, names_pos,
+		dep, family, journal, draft, recipe_rel, recipe, record;
+} frame;
+
+static struct {
+	frame	*buf;
+	int	size, used;
+} frames;
+
+static struct {
+	char	*buf;
+	size_t	size, used;
+} names;
+
+#define name_at(pos)	(names.buf + (pos))
+
+
+static size_t
+names_alloc(size_t len)
+{
+	size_t pos = names.used;
+
+	if (names.size - names.used < len) {
+		size_t new_size = names.size + len + PATH_MAX;
+		char  *new_buf = realloc(names.buf, new_size);
+
+		if (!new_buf) {
+			pperror("realloc");
+			return SIZE_MAX;
+		}
+		names.size = new_size;
+		names.buf  = new_buf;
+	}
+
+	names.used += len;
+
+	return pos;
+}
+
+
+/*
+	Pushes the frame for the dependency named at path relative to dir.
+	Returns OK if pushed, otherwise ERROR.
+*/
+
+static int
+descend(int dir, size_t path)
+{
+	char *dep_path = name_at(path), *dep;
+
+	frame *f;
+
+
+	if (strchr(dep_path, TRACK_DELIM)) {
+		msg("Illegal symbol "stringize(TRACK_DELIM), dep_path);
+		return ERROR;
+	}
+
+	dep = dir_enter(&dir, dep_path);
+
+	if (!dep) {
+		msg("Missing dependency directory", dep_path);
+		return ERROR;
+	}
+
+	if (strlen(dep) > (NAME_MAX + 1 - sizeof tmp_prefix)) {
+		msg("Dependency name too long", dep);
+		return ERROR;
+	}
+
+	if (frames.used == frames.size) {
+		int new_size = frames.size ? 2 * frames.size : 64;
+		frame *new_buf = realloc(frames.buf, new_size * sizeof (frame));
+
+		if (!new_buf) {
+			pperror("realloc");
+			return ERROR;
+		}
+		frames.size = new_size;
+		frames.buf  = new_buf;
+	}
+
+	f = frames.buf + frames.used++;
+
+	f->step = START;
+	f->dir = dir;
+	f->dep = path + (dep - dep_path);
+	f->cutoff = track_used();
+	f->names_pos = names.used;
+
+	indent += INDENT_PER_LEVEL;
+
+	return OK;
+}
+
+
+/*
+	Pops the frame and hands its result over to the parent's err and
+	hint, just as update_dep() does for its caller.
+*/
+
+static int
+ascend(int err, int base)
+{
+	frame *f = frames.buf + --frames.used;
+
+	indent -= INDENT_PER_LEVEL;
+	track_truncate(f->cutoff);
+	names.used = f->names_pos;
+
+	if (frames.used > base) {
+		f--;
+		f->err  = err & ERRORS;
+		f->hint = err & HINTS;
+	}
+
+	return err;
+}
+
+
+/*
+	If REDO_VERIFY_JOBS is more than 1 then the dependencies listed in
+	the long journal are verified ahead by that many forked helpers,
+	taking the records one by one. The helpers do not run the recipes,
+	the target needing its recipe run is BUSY for them. The verified
+	targets get their journals refreshed, so the following sequential
+	walk passes them at once. The helpers stop at the first record found
+	changed, as the sequential walk does, since the records following it
+	may be no longer needed.
+*/
+
+#define VERIFY_JOBS_MAX 64
+
+static int update_dep(int dir, char *dep_path, int *hint);
+static int sibling_listed(int dir, const char *name);
+static int stats_open(void);
+static void stats_close(int stats_fd, int log_owner);
+
+static void
+verify_ahead(int dir, FILE *journal_f, const char *recipe_rel, const char *dep)
+{
+	struct {
+		int next, stale;
+	} *shared;
+
+	char *list, *record, *self;
+
+	int num, i, k, n, err, hint, stale, stats_fd;
+
+	pid_t pid[VERIFY_JOBS_MAX];
+
+
+	list = journal_list(journal_f, &num);
+	self = strdup(dep);	/* the names may be relocated by helpers */
+
+	shared = mmap(0, sizeof *shared, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (!list || !self || (shared == MAP_FAILED) ||
+	    (num < 2 * verify_jobs) || strcmp(list + NAME_OFFSET, recipe_rel))
+		num = 0;
+
+	if (num) {
+		shared->next = 0;
+		shared->stale = num;
+	}
+
+	n = num ? MIN(verify_jobs, VERIFY_JOBS_MAX) : 0;
+
+	for (k = 0; k < n; k++) {
+		pid[k] = fork();
+		if (pid[k] != 0)
+			continue;
+
+		verify_jobs = prefetching = log_fd = 0;
+		verifying = 1;
+		stats_f = 0;	/* the owner's, reported to it as the child */
+		memset(counter, 0, sizeof counter);
+
+		record = list;
+		k = 0;		/* the record's index */
+
+		while ((i = __atomic_fetch_add(&shared->next, 1,
+						__ATOMIC_RELAXED)) <
+		       __atomic_load_n(&shared->stale, __ATOMIC_RELAXED)) {
+
+			for ( ; k < i; k++)
+				record = strchr(record, '\0') + 1;
+
+			if (!strcmp(record + NAME_OFFSET, self))
+				continue;
+
+			err = update_dep(dir, record + NAME_OFFSET, &hint);
+
+			if ((err == OK) ? !dep_changed(dir, record, hint, 0) :
+			    ((err == BUSY) && (hint & IMMEDIATE_DEPENDENCY)))
+				continue;	/* unchanged or locked */
+
+			stale = shared->stale;
+			while ((i < stale) &&
+			       !__atomic_compare_exchange_n(&shared->stale,
+					&stale, i, 0, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED));
+		}
+
+		stats_fd = stats_open();
+		if (stats_fd >= 0)
+			stats_close(stats_fd, 0);
+		_exit(OK);
+	}
+
+	for (k = 0; k < n; k++)
+		if (pid[k] > 0)
+			waitpid(pid[k], 0, 0);
+
+	if (shared != MAP_FAILED)
+		munmap(shared, sizeof *shared);
+	free(self);
+	free(list);
+}
+
+
+/*
+	With -y no recipes are run and no journals are written, every target
+	which would be rebuilt is reported to stdout with the first cause
+	found in its journal walk. The stale dependencies make their
+	dependents stale. The verdicts are memoized by the whole target name,
+	since the target is not marked as built by its journal's date.
+*/
+
+static struct {
+	char	**slot;	/* '0' or '1' (stale) followed by the whole name */
+	int	num, size;
+} verdicts;
+
+
+static char **
+verdict_find(const char *whole)
+{
+	int i = dirs_hash(whole) & (verdicts.size - 1);
+
+	while (verdicts.slot[i] && strcmp(verdicts.slot[i] + 1, whole))
+		i = (i + 1) & (verdicts.size - 1);
+
+	return verdicts.slot + i;
+}
+
+
+static int
+verdict_get(const char *whole)
+{
+	char **v;
+
+	if (!verdicts.size)
+		return -1;
+
+	v = verdict_find(whole);
+
+	return *v ? (**v == '1') : -1;
+}
+
+
+static void
+verdict_put(const char *whole, int stale)
+{
+	char **slot = verdicts.slot, **v;
+	int i, size = verdicts.size;
+
+	if (2 * (verdicts.num + 1) > verdicts.size) {
+		verdicts.size = size ? 2 * size : 1024;
+		verdicts.slot = calloc(verdicts.size, sizeof (char *));
+		if (!verdicts.slot) {
+			perror("verdicts");
+			exit(ERROR);
+		}
+		for (i = 0; i < size; i++)
+			if (slot[i])
+				*verdict_find(slot[i] + 1) = slot[i];
+		free(slot);
+	}
+
+	v = verdict_find(whole);
+	if (!*v && (*v = malloc(strlen(whole) + 2))) {
+		sprintf(*v, "%d%s", stale, whole);
+		verdicts.num++;
+	}
+}
+
+
+static void
+explain(frame *f, const char *cause, const char *record)
+{
+	if (nflag)
+		return;
+
+	dprintf(1, "  { target = \"%s\", cause = \"%s\"",
+					track_buf() + f->whole_pos, cause);
+
+	if (record)
+		dprintf(1, ", dep = \"%s\"", record + NAME_OFFSET);
+
+	if (!strcmp(cause, "recipe"))
+		dprintf(1, ", recipe = \"%s\"", name_at(f->recipe_rel));
+	else if (!strcmp(cause, "changed"))
+		dprintf(1, ",\n    hash = { \"%.*s\", \"%.*s\" },"
+			"\n    date = { \"%.*s\", \"%.*s\" }",
+			HEXHASH_LEN, record, HEXHASH_LEN, hexhash,
+			HEXDATE_LEN, record + DATE_OFFSET,
+			HEXDATE_LEN, hexdate);
+
+	dprintf(1, " },\n");
+}
+
+
+static int
+start(frame *f)
+{
+	char	*dep = name_at(f->dep), *whole, *recipe,
+		*family, *journal, *draft, *recipe_rel;
+
+	size_t dep_len = strlen(dep), pos;
+
+	struct stat st;
+
+	int err;
+
+
+	f->whole_pos = track_used() + 1;
+	f->records_pos = records.used;
+
+	whole = track_append(f->dir, dep);
+	if (!whole) {
+		msg("Dependency loop attempt", track_buf());
+		return wflag ? IS_SOURCE : ERROR;
+	}
+
+	log_name();
+
+	if ((err = verdict_get(whole)) >= 0)
+		return err ? OUT_OF_DATE : OK;
+
+	pos = names_alloc((dep_len + sizeof recipe_suffix) +
+			  (sizeof journal_prefix + dep_len) +
+			  (sizeof draft_prefix + dep_len) + PATH_MAX);
+	if (pos == SIZE_MAX)
+		return ERROR;
+
+	dep = name_at(f->dep);
+	family = name_at(pos);
+	journal = family + dep_len + sizeof recipe_suffix;
+	draft = journal + sizeof journal_prefix + dep_len;
+	recipe_rel = draft + sizeof draft_prefix + dep_len;
+
+	f->family = pos;
+	f->journal = journal - names.buf;
+	f->draft = draft - names.buf;
+	f->recipe_rel = recipe_rel - names.buf;
+
+	if (fflag)
+		dprintf(1, "--[[\n");
+
+	memcpy(family, dep, dep_len + 1);	/* dep precedes the new names */
+	recipe = find_recipe(f->dir, family, recipe_rel, PATH_MAX, whole);
+
+	if (fflag)
+		dprintf(1, "--]]\n");
+
+	strcpy(stpcpy(journal, journal_prefix), dep);
+
+	f->sibling = !recipe;
+	if (f->sibling) {	/* the sibling output of another target? */
+		if (!sibling_listed(f->dir, dep))
+			return IS_SOURCE;
+		count(STATS, 1);
+		if (fstatat(at(f->dir), journal, &st, 0))
+			return IS_SOURCE;
+		recipe = recipe_rel;
+		*recipe_rel = '\0';
+	}
+
+	f->recipe = recipe - names.buf;
+	names.used = f->recipe_rel + strlen(recipe_rel) + 1;
+
+
+	datefile(f->dir, journal, &st);
+
+	if (strcmp(hexdate, build_date) >= 0) {
+		err = (st.st_mode & S_IRUSR) ? OK : ERROR;
+		log_err();
+		return err;
+	}
+
+
+	strcpy(stpcpy(draft, draft_prefix), dep);
+	f->draft_fd = (yflag || f->sibling) ? -1 : draft_open(f->dir, draft);
+
+	if ((f->draft_fd < 0) && !yflag && !f->sibling) {
+		if (errno == EEXIST)
+			err = BUSY | IMMEDIATE_DEPENDENCY;
+		else {
+			pperror("open exclusive");
+			err = ERROR;
+		}
+		log_err();
+		return err;
+	}
+
+
+	log_time("{       t0 = %ld,");
+
+	f->journal_mode = st.st_mode;
+	f->journal_f = fopenat(f->dir, journal);
+	f->journaled = (f->journal_f != 0);
+
+	if (yflag && !f->journaled)
+		explain(f, st.st_ctime ? "failed" : "untracked", 0);
+
+	if (f->journaled && (verify_jobs > 1))
+		verify_ahead(f->dir, f->journal_f, recipe_rel, dep);
+
+	f->prefetch = f->journaled ? prefetch_open(f->dir, f->journal_f) : 0;
+	f->new_recipe = !f->sibling;	/* the primary goes first instead */
+	f->up_to_date = 0;
+	f->stale = 0;
+	f->failed = OK;
+	f->err = OK;
+	f->hint = 0;
+	f->step = f->journaled ? VERIFY : RECIPE;
+
+	return OK;
+}
+
+
+static void
+journal_over(frame *f)
+{
+	fclose(f->journal_f);
+	f->journal_f = 0;
+	prefetch_close(f->prefetch);
+	f->prefetch = 0;
+	names.used = f->record;
+	f->hint = 0;
+	f->step = RECIPE;
+}
+
+
+static void
+verify(frame *f)
+{
+	char *record, *filename;
+
+	int i = f - frames.buf, err;
+
+	f->record = names_alloc(RECORD_SIZE);
+	if (f->record == SIZE_MAX) {
+		f->err = ERROR;
+		f->record = names.used;
+		journal_over(f);
+		return;
+	}
+
+	record = name_at(f->record);
+
+	if (!read_record(record, f->journal_f, name_at(f->journal))) {
+		if (yflag)
+			explain(f, "incomplete", 0);
+		journal_over(f);
+		return;
+	}
+
+	names.used = f->record + strlen(record) + 1;
+	filename = record + NAME_OFFSET;
+
+	f->hint = IS_SOURCE;
+	f->step = COMPARE;
+
+	if (f->new_recipe &&
+	    (f->new_recipe = strcmp(filename, name_at(f->recipe_rel)))) {
+		if (yflag)
+			explain(f, "recipe", record);
+		journal_over(f);
+	} else if (strcmp(filename, name_at(f->dep))) {
+		err = descend(f->dir, f->record + NAME_OFFSET);
+		frames.buf[i].err = err;	/* frames may be relocated */
+	}
+}
+
+
+static void
+compare(frame *f)
+{
+	char	*record = name_at(f->record),
+		*filename = record + NAME_OFFSET;
+
+	const char *cause = "changed";
+
+	if (f->err ||
+	    ((f->hint & OUT_OF_DATE) && (cause = "stale")) ||
+	    dep_changed(f->dir, record, f->hint, f->prefetch) ||
+	    (f->err = write_dep(f->dir, filename, UPDATED_RECENTLY)) ||
+	    (!strcmp(filename, name_at(f->dep)) && (f->up_to_date = 1))) {
+		if (yflag && !f->up_to_date)
+			explain(f, f->err ? "error" : cause, record);
+		if (kflag && f->err && (f->err != BUSY) && !f->failed)
+			f->failed = f->err;
+		if ((nflag && !f->err) || (f->failed && (f->err != BUSY))) {
+			f->stale |= !f->up_to_date;	/* the rest too */
+			f->up_to_date &= !f->failed;
+			f->err = OK;
+			names.used = f->record;
+			f->step = VERIFY;
+		} else
+			journal_over(f);
+	} else {
+		names.used = f->record;
+		f->step = VERIFY;
+	}
+}
+
+
+/*
+	The sibling output is stale, but was not committed in this build.
+	If its primary is unchanged, then the sibling was modified or
+	removed since, so the primary's journal is dropped and the primary
+	is rebuilt on the next pass.
+*/
+
+static int
+sibling_stale(int dir, char *journal, const char *whole, const char *record)
+{
+	char primary[NAME_MAX + 1], *name;
+
+	size_t len;
+
+	struct stat st;
+
+
+	datefile(dir, journal, &st);
+	if (strcmp(hexdate, build_date) >= 0)
+		return OK;	/* committed meanwhile */
+
+	if (record) {
+		name = stpcpy(primary, journal_prefix);
+		len = strchr(record, '\n') - (record + NAME_OFFSET);
+		if (len + sizeof journal_prefix <= sizeof primary) {
+			memcpy(name, record + NAME_OFFSET, len);
+			name[len] = '\0';
+			if (!unlinkat(at(dir), primary, 0) || (errno == ENOENT))
+				return BUSY;
+		}
+	}
+
+	msg("Sibling output not committed by its primary", whole);
+
+	return ERROR;
+}
+
+
+static int
+build(frame *f)
+{
+	char	*dep = name_at(f->dep),
+		*recipe_rel = name_at(f->recipe_rel),
+		*journal = name_at(f->journal),
+		*whole = track_buf() + f->whole_pos;
+
+	int err = f->err ? f->err : f->failed, i = f - frames.buf;
+
+
+	if (yflag) {
+		records.used = f->records_pos;
+		log_close_level();
+		if (!err)
+			verdict_put(whole, f->stale || !f->up_to_date);
+		return	err ? err : (f->stale || !f->up_to_date) ?
+			OUT_OF_DATE : UPDATED_RECENTLY;
+	}
+
+	if (f->sibling) {
+		if (!err && !f->up_to_date)
+			err = sibling_stale(f->dir, journal, whole,
+				(records.used > f->records_pos) ?
+				records.buf + f->records_pos : 0);
+		records.used = f->records_pos;
+		log_close_level();
+		return err | (f->up_to_date ? UPDATED_RECENTLY : 0);
+	}
+
+	if (f->up_to_date)
+		err = flush_deps(f->draft_fd, f->records_pos);
+	else if (!err) {
+		records.used = f->records_pos;	/* drop the verified ones */
+
+		(void)(
+			(err = write_dep(f->dir, recipe_rel, f->hint)) ||
+			(err = flush_deps(f->draft_fd, f->records_pos)) ||
+			(err = run_recipe(f->dir, f->draft_fd, recipe_rel, dep,
+					name_at(f->family),
+					f->recipe - f->recipe_rel))
+		);
+
+		/*
+			The remote rounds walk the dependencies, so the
+			frames, names and track may be relocated.
+		*/
+
+		f = frames.buf + i;
+		dep = name_at(f->dep);
+		recipe_rel = name_at(f->recipe_rel);
+		journal = name_at(f->journal);
+		whole = track_buf() + f->whole_pos;
+
+		(void)(err ||
+			(err = write_dep(f->dir, dep, IS_SOURCE)) ||
+			(err = flush_deps(f->draft_fd, f->records_pos))
+		);
+
+		if (err && (err != BUSY) && cancelled())
+			err = BUSY;	/* the fallout of another failure */
+
+		if (err && (err != BUSY)) {
+			cancel();
+			count(OPENS, !f->journaled);
+			if (f->journaled)
+				fchmodat(at(f->dir), journal,
+					f->journal_mode & (~S_IRUSR), 0);
+			else
+				close(openat(at(f->dir), journal,
+							CR_WR_TR, 0222));
+			log_guard(open_comment);
+			dprintf(2, "redo %*s%s\n     %*s%s -> %d\n",
+				indent,"", whole, indent,"", recipe_rel, err);
+			log_guard(close_comment);
+		}
+	}
+
+	records.used = f->records_pos;
+
+	log_close_level();
+
+	err = choose(f->dir, journal, name_at(f->draft), err);
+
+	close(f->draft_fd);	/* unlock after the draft is gone */
+
+	return err | UPDATED_RECENTLY;
+}
+
+
+static int
+update_dep(int dir, char *dep_path, int *hint)
+{
+	size_t names_pos = names.used, path = names_alloc(strlen(dep_path) + 1);
+
+	int err = ERROR, base = frames.used, i, e;
+
+	frame *f;
+
+
+	if (path != SIZE_MAX) {
+		strcpy(name_at(path), dep_path);
+		if (descend(dir, path) != OK)
+			base = frames.used;	/* nothing to walk */
+	}
+
+	while (frames.used > base) {
+		f = frames.buf + frames.used - 1;
+
+		switch (f->step) {
+		case START:
+			err = start(f);
+			if (f->step == START)
+				err = ascend(err, base);
+			break;
+		case VERIFY:
+			verify(f);
+			break;
+		case COMPARE:
+			compare(f);
+			break;
+		case RECIPE:
+			f->step = BUILD;
+			if (f->new_recipe) {
+				i = f - frames.buf;
+				e = descend(f->dir, f->recipe_rel);
+				frames.buf[i].err = e;	/* may be relocated */
+			}
+			break;
+		case BUILD:
+			err = ascend(build(f), base);
+			break;
+		}
+	}
+
+	names.used = names_pos;
+
+	*hint = err & HINTS;
+
+	return err & ERRORS;
+}
+
+/*
+	Remote workers. If REDO_WORKER is set then the recipe is dispatched
+	to the worker started by REDO_WORKER command (e.g. "ssh host redo -W"
+	or "redo -W" as the local stand-in). The worker is talked to through
+	the transport's stdin and stdout with the frames, each being the
+	header line followed by length bytes of payload:
+
+		<type> <length> <name>\n<payload>
+
+		c	directory to run the recipe in, inside the sandbox
+		f, x	plain or executable file
+		r	run the recipe, "target\nfamily\ntmp\nreldir\n" payload
+		d	dependencies reported by depends-on, one per line
+		e	recipe's stdout and stderr
+		s	exit status of the recipe as the name
+
+	The recipe and the files listed in the target's journal are shipped,
+	the output ($3) and the dependencies are returned. The dependencies
+	are updated and recorded locally just as depends-on would do. If
+	some of them were not shipped or were changed by the update, then
+	the recipe is dispatched again with them, no more than REDO_ROUNDS
+	times in total, and then run locally. The recipe's output is printed
+	only by the round which is not repeated.
+*/
+
+#define ROUNDS_DEFAULT 3
+
+static int rounds;
+
+/* names are kept as "\nname\n" lines, so that strstr() finds them */
+
+static int
+want(buffer *wanted, const char *name)
+{
+	size_t len = strlen(name);
+	int err = OK;
+
+	if (!wanted->used)
+		err = buffer_add(wanted, "\n", 1);
+
+	if (!err && (strncmp(name, "/", 1) != 0)) {
+		size_t pos = wanted->used;
+
+		err =	buffer_add(wanted, name, len) ||
+			buffer_add(wanted, "\n", 1);
+
+		if (!err && (strstr(wanted->buf, wanted->buf + pos - 1) <
+						wanted->buf + pos - 1))
+			wanted->used = pos;	/* already wanted */
+	}
+
+	return err;
+}
+
+
+static int
+frame_put(FILE *f, int type, const char *name, const char *data, size_t len)
+{
+	return	(fprintf(f, "%c %zu %s\n", type, len, name) < 0) ||
+		(fwrite(data, 1, len, f) != len);
+}
+
+
+/* Returns the payload terminated with '\0', name has PATH_MAX size */
+
+static char *
+frame_get(FILE *f, int *type, size_t *len, char *name)
+{
+	char head[PATH_MAX + 32], t, *eol, *data;
+	int pos;
+
+	if (!fgets(head, sizeof head, f) || !(eol = strchr(head, '\n')) ||
+	    (sscanf(head, "%c %zu %n", &t, len, &pos) < 2) ||
+	    ((eol - head) - pos >= PATH_MAX))
+		return 0;
+
+	*eol = '\0';
+	strcpy(name, head + pos);
+	*type = t;
+
+	data = malloc(*len + 1);
+	if (data && (fread(data, 1, *len, f) != *len)) {
+		free(data);
+		data = 0;
+	}
+	if (data)
+		data[*len] = '\0';
+
+	return data;
+}
+
+
+static char *
+slurp(int dir, const char *name, size_t *len, int *exec)
+{
+	struct stat st;
+	char *data = 0;
+	ssize_t r = 0;
+	int fd = openat(at(dir), name, O_RDONLY | O_CLOEXEC);
+
+	count(OPENS, 1);
+	if (fd < 0)
+		return 0;
+
+	count(STATS, 1);
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) &&
+	    (data = malloc(st.st_size + 1))) {
+		for (*len = 0; *len < (size_t) st.st_size; *len += r) {
+			r = read(fd, data + *len, st.st_size - *len);
+			if (r <= 0)
+				break;
+		}
+		*exec = (st.st_mode & S_IXUSR) != 0;
+	}
+
+	close(fd);
+
+	if (r < 0) {
+		free(data);
+		data = 0;
+	}
+
+	return data;
+}
+
+
+static int
+spill(int dir, char *name, const char *data, size_t len, int exec)
+{
+	char *slash;
+	ssize_t w;
+	int fd;
+
+	for (slash = name; (slash = strchr(slash + 1, '/')); ) {
+		*slash = '\0';
+		mkdirat(at(dir), name, 0777);
+		*slash = '/';
+	}
+
+	fd = openat(at(dir), name, CR_WR_TR | O_CLOEXEC, exec ? 0777 : 0666);
+	count(OPENS, 1);
+	if (fd < 0) {
+		pperror(name);
+		return ERROR;
+	}
+
+	for ( ; len ; data += w, len -= w) {
+		w = write(fd, data, len);
+		if (w < 0) {
+			pperror("write");
+			break;
+		}
+	}
+
+	return close(fd) || len;
+}
+
+
+/* How many levels above its directory the relative name reaches */
+
+static int
+updirs(const char *name)
+{
+	int depth = 0, top = 0;
+
+	while (name && *name) {
+		if ((strncmp(name, "../", 3) == 0) || (strcmp(name, "..") == 0))
+			depth--;
+		else if (strncmp(name, "./", 2) && strcmp(name, "."))
+			depth++;
+
+		if (top > depth)
+			top = depth;
+
+		name = strchr(name, '/');
+		while (name && (*name == '/'))
+			name++;
+	}
+
+	return -top;
+}
+
+
+static pid_t
+transport(FILE **to, FILE **from)
+{
+	int in[2], out[2];
+	pid_t pid;
+
+	if (pipe2(in, O_CLOEXEC)) {
+		pperror("pipe");
+		return -1;
+	}
+
+	if (pipe2(out, O_CLOEXEC)) {
+		pperror("pipe");
+		close(in[0]);
+		close(in[1]);
+		return -1;
+	}
+
+	pid = fork();
+	if (pid == 0) {
+		signal(SIGPIPE, SIG_DFL);
+		if ((dup2(in[0], 0) < 0) || (dup2(out[1], 1) < 0)) {
+			perror("dup2");
+			exit(ERROR);
+		}
+		execl("/bin/sh", "/bin/sh", "-c", worker, (char *)0);
+		perror("execl");
+		exit(ERROR);
+	}
+
+	close(in[0]);
+	close(out[1]);
+
+	if (pid < 0) {
+		pperror("fork");
+		close(in[1]);
+		close(out[0]);
+	} else {
+		*to = fdopen(in[1], "w");
+		*from = fdopen(out[0], "r");
+	}
+
+	return pid;
+}
+
+
+/*
+	Runs the recipe by the worker once. Returns the dependencies reported
+	or 0 if the worker failed to respond. The recipe's stdout and stderr
+	are kept in output.
+*/
+
+static char *
+remote(int dir, buffer *wanted, buffer *shipped, buffer *output,
+	const char *recipe_rel, const char *target, const char *family,
+			const char *tmp, const char *reldir, int *status)
+{
+	char	name[PATH_MAX], *deps = 0, *data, *s, *eol, *args;
+
+	int	type, exec, depth = 0, replied = 0, err = OK;
+
+	size_t	len;
+
+	struct stat st;
+
+	FILE	*to, *from;
+
+	void	(*sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+	pid_t	pid = transport(&to, &from);
+
+
+	if (pid < 0)
+		return 0;
+
+	for (s = wanted->buf + 1; (eol = strchr(s, '\n')); s = eol + 1) {
+		*eol = '\0';
+		if (depth < updirs(s))
+			depth = updirs(s);
+		*eol = '\n';
+	}
+
+	for (s = name; depth-- > 0; s = stpcpy(s, "_/"));
+	strcpy(s, ".");
+	err = frame_put(to, 'c', name, "", 0);
+
+	shipped->used = 0;
+	buffer_add(shipped, "\n", 1);
+
+	for (s = wanted->buf + 1; !err && (eol = strchr(s, '\n'));
+								s = eol + 1) {
+		*eol = '\0';
+		data = slurp(dir, s, &len, &exec);
+		if (data) {
+			datefile(dir, s, &st);
+			hexdate[HEXDATE_LEN] = ' ';
+			err =	frame_put(to, exec ? 'x' : 'f', s, data, len) ||
+				buffer_add(shipped, hexdate, HEXDATE_LEN + 1) ||
+				buffer_add(shipped, s, eol - s) ||
+				buffer_add(shipped, "\n", 1);
+			free(data);
+		}
+		*eol = '\n';
+	}
+
+	len = strlen(target) + strlen(family) + strlen(tmp) + strlen(reldir);
+	args = malloc(len + sizeof "\n\n\n\n");
+	if (!args)
+		pperror("malloc");
+	else if (!err) {
+		sprintf(args, "%s\n%s\n%s\n%s\n", target, family, tmp, reldir);
+		frame_put(to, 'r', recipe_rel, args, strlen(args));
+	}
+	free(args);
+
+	fclose(to);
+
+	output->used = 0;
+
+	while ((data = frame_get(from, &type, &len, name))) {
+		switch (type) {
+		case 'f':
+		case 'x':
+			if (strcmp(name, tmp) == 0)
+				spill(dir, name, data, len, type == 'x');
+			break;
+		case 'd':
+			free(deps);
+			deps = data;
+			data = 0;
+			break;
+		case 'e':
+			output->used = 0;
+			buffer_add(output, data, len);
+			break;
+		case 's':
+			*status = atoi(name);
+			replied = 1;
+			break;
+		}
+		free(data);
+	}
+
+	fclose(from);
+	waitpid(pid, 0, 0);
+	signal(SIGPIPE, sigpipe);
+
+	if (!replied) {
+		msg("No reply from worker", worker);
+		free(deps);
+		return 0;
+	}
+
+	count(REMOTES, 1);
+
+	return deps ? deps : strdup("");
+}
+
+
+static int
+dispatch(int dir, int fd, char *recipe_rel, const char *target,
+		const char *family, const char *tmp, const char *reldir)
+{
+	buffer	wanted = {0}, shipped = {0}, output = {0};
+
+	char	journal[NAME_MAX + 1], record[RECORD_SIZE],
+		*deps = 0, *dep, *eol;
+
+	int	round, status = ERROR, hint, stale, err = -1;
+
+	size_t	pos = records.used;
+
+	struct stat st;
+
+	FILE	*f;
+
+
+	strcpy(stpcpy(journal, journal_prefix), target);
+
+	err = want(&wanted, recipe_rel) ? ERROR : -1;
+
+	f = fopenat(dir, journal);
+	if (f) {
+		while ((err < 0) && read_record(record, f, journal))
+			if (strcmp(record + NAME_OFFSET, target) &&
+			    want(&wanted, record + NAME_OFFSET))
 				err = ERROR;
+		fclose(f);
+	}
+
+	for (round = 0; (err < 0) && (round < rounds); round++) {
+
+		if ((lstatat(dir, tmp, &st) == 0) && removeat(dir, tmp, &st))
+			pperror("remove tmp");
+
+		deps = remote(dir, &wanted, &shipped, &output, recipe_rel,
+					target, family, tmp, reldir, &status);
+		if (!deps)
+			break;
+
+		err = OK;
+		stale = 0;
+
+		for (dep = deps; !err && (eol = strchr(dep, '\n'));
+							dep = eol + 1) {
+			char key[RECORD_SIZE + 2], *k;
+
+			*eol = '\0';
+			if (!*dep)
+				continue;
+
+			(void)(
+				(err = update_dep(dir, dep, &hint)) ||
+				(err = write_dep(dir, dep, hint))
+			);
+
+			k = stpcpy(key, "\n");
+			memcpy(k, hexdate, HEXDATE_LEN);
+			k = stpcpy(stpcpy(k + HEXDATE_LEN, " "), dep);
+			strcpy(k, "\n");
+
+			if (!err && (*dep != '/') &&
+			    !strstr(shipped.buf, key)) {
+				stale = 1;
+				err = want(&wanted, dep);
+			}
+		}
+
+		free(deps);
+
+		if (!stale && output.used)	/* the round is not repeated */
+			dprintf(2, "%.*s", (int) output.used, output.buf);
+
+		if (!err && stale)
+			err = -1;
+		else if (!err)
+			err = status ? status : flush_deps(fd, pos);
+
+		if (err)
+			records.used = pos;
+	}
+
+	if (err < 0) {
+		msg("Running locally", target);
+		if ((lstatat(dir, tmp, &st) == 0) && removeat(dir, tmp, &st))
+			pperror("remove tmp");
+	}
+
+	free(wanted.buf);
+	free(shipped.buf);
+	free(output.buf);
+
+	return err;
+}
+
+
+/*
+	The lexical normalization of the absolute path in place, the
+	symlinks are not resolved.
+*/
+
+static void
+tidy(char *path)
+{
+	char *r = path, *w = path;
+
+	while (*r) {
+		if ((r[0] == '/') && (r[1] == '/')) {
+			r++;
+			continue;
+		}
+		if ((r[0] == '/') && (r[1] == '.') &&
+		    ((r[2] == '/') || !r[2])) {
+			r += 2;
+			continue;
+		}
+		if ((r[0] == '/') && (r[1] == '.') && (r[2] == '.') &&
+		    ((r[3] == '/') || !r[3])) {
+			r += 3;
+			while ((w > path) && (*--w != '/'));
+			continue;
+		}
+		*w++ = *r++;
+	}
+
+	if (w == path)
+		*w++ = '/';
+	*w = '\0';
+}
+
+
+/* The absolute path relative to the absolute directory */
+
+static char *
+relative(const char *from, const char *path, char *rel, size_t size)
+{
+	size_t i, common = 0, len;
+	char *s = rel;
+
+	for (i = 0; from[i] && (from[i] == path[i]); i++)
+		if (from[i] == '/')
+			common = i;
+	if (!from[i] && (path[i] == '/'))
+		common = i;
+
+	for (i = common; from[i]; i++)
+		if ((from[i] == '/') && from[i + 1]) {
+			if (s + 3 >= rel + size)
+				return 0;
+			s = stpcpy(s, "../");
+		}
+
+	len = strlen(path + common + 1);
+	if (s + len >= rel + size)
+		return 0;
+	strcpy(s, path + common + 1);
+
+	return rel;
+}
+
+
+static int
+autodep_collect(int dir, int fd, const char *recipe_rel, const char *target)
+{
+	buffer	seen = {0};
+
+	char	name[NAME_MAX + 1], rel[PATH_MAX], *log, *path, *eol, *base,
+		*root = getenv("REDO_AUTODEP_ROOT"), *data;
+
+	size_t	len, root_len = root ? strlen(root) : 0, pos = records.used;
+
+	int	exec, err;
+
+	struct stat st;
+
+
+	strcpy(stpcpy(name, draft_prefix), target);
+	data = slurp(dir, name, &len, &exec);
+
+	err =	buffer_add(&seen, "\n", 1) ||
+		(data && buffer_add(&seen, data, len)) ||
+		buffer_add(&seen, " ", 1) ||
+		buffer_add(&seen, target, strlen(target)) ||
+		buffer_add(&seen, "\n", 1);
+	free(data);
+
+	log = slurp(0, autodep_log, &len, &exec);
+	if (!log)
+		err = ERROR;
+	else
+		log[len] = '\0';
+
+	if (root_len == 1)
+		root_len = 0;	/* "/" */
+
+	for (path = log; !err && (eol = strchr(path, '\n')); path = eol + 1) {
+		*eol = '\0';
+
+		tidy(path);
+		if ((*path != '/') || !root ||
+		    strncmp(path, root, root_len) || (path[root_len] != '/') ||
+		    !relative(dir_path(dir), path, rel + 1, sizeof rel - 2))
+			continue;
+
+		base = strrchr(path, '/') + 1;
+		if (!strncmp(base, journal_prefix, sizeof journal_prefix - 1) ||
+		    !strcmp(rel + 1, recipe_rel))
+			continue;
+
+		*rel = ' ';
+		strcat(rel, "\n");
+		if (strstr(seen.buf, rel))
+			continue;
+
+		err = buffer_add(&seen, rel, strlen(rel));
+		rel[strlen(rel) - 1] = '\0';
+
+		count(STATS, 1);
+		if (!err && !fstatat(at(dir), rel + 1, &st, 0) &&
+		    S_ISREG(st.st_mode))
+			err = write_dep(dir, rel + 1, 0);
+	}
+
+	free(log);
+	free(seen.buf);
+
+	return err ? ERROR : flush_deps(fd, pos);
+}
+
+
+/*
+	The siblings are marked by their names in the directory's index,
+	the journal of the empty name ".do..". start() consults it only for
+	the names without recipes, and it is read once per directory between
+	the recipes, so the sources cost no syscall, and the former target
+	whose recipe was removed is the source despite its journal.
+*/
+
+static int
+sibling_listed(int dir, const char *name)
+{
+	folder	*d = dirs.dir + dir;
+
+	char	*s, *eol;
+
+	size_t	len = 0;
+
+	int	exec;
+
+
+	if (!d->siblings) {
+		d->siblings = slurp(dir, journal_prefix, &len, &exec);
+		if (d->siblings)
+			d->siblings[len] = '\0';
+		else
+			d->siblings = calloc(1, 1);
+		if (!d->siblings)
+			return 0;
+	}
+
+	len = strlen(name);
+	for (s = d->siblings; (eol = strchr(s, '\n')); s = eol + 1)
+		if (((size_t) (eol - s) == len) && !memcmp(s, name, len))
+			return 1;
+
+	return 0;
+}
+
+
+static int
+sibling_list(int dir, const char *name)
+{
+	int fd, err;
+
+
+	if (sibling_listed(dir, name))
+		return OK;
+
+	fd = openat(at(dir), journal_prefix,
+			O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+	count(OPENS, 1);
+
+	err = (fd < 0) || (dprintf(fd, "%s\n", name) < 0);
+	if ((fd >= 0) && close(fd))
+		err = 1;
+
+	free(dirs.dir[dir].siblings);
+	dirs.dir[dir].siblings = 0;
+
+	if (err) {
+		pperror("sibling index");
+		return ERROR;
+	}
+
+	return OK;
+}
+
+
+/*
+	The sibling outputs are written by the recipe to the tmp names
+	("${3%$1}name") in the target's directory and are committed after
+	the target. The sibling has no recipe, its journal lists the target
+	(the primary) and the sibling itself, so it is verified just as the
+	target built by the primary's recipe, see start(). The primary's
+	record is computed once and kept in the records buffer for all the
+	siblings.
+*/
+
+static int
+outputs_commit(int dir, const char *target, int err)
+{
+	char	primary[NAME_MAX + 1], tmp[NAME_MAX + 1],
+		draft[NAME_MAX + 1], journal[NAME_MAX + 1],
+		*list, *name, *eol;
+
+	size_t	len, pos = records.used, primary_end;
+
+	int	exec, draft_fd, e;
+
+	struct stat st;
+
+
+	list = slurp(0, outputs, &len, &exec);
+	unlink(outputs);
+	*outputs = '\0';
+
+	if (!list || !len) {
+		free(list);
+		return err;
+	}
+	list[len] = '\0';
+
+	strcpy(primary, target);
+	if (!err)
+		err = write_dep(dir, primary, IS_SOURCE);
+	primary_end = records.used;
+
+	for (name = list; (eol = strchr(name, '\n')); name = eol + 1) {
+		*eol = '\0';
+
+		if (!*name || !strcmp(name, target))
+			continue;
+
+		if (strchr(name, '/') ||
+		    (strlen(name) + sizeof tmp_prefix > sizeof tmp)) {
+			msg("Sibling output outside of the target's directory",
+									name);
+			err = ERROR;
+			continue;
+		}
+
+		strcpy(stpcpy(tmp, tmp_prefix), name);
+		strcpy(stpcpy(draft, draft_prefix), name);
+		strcpy(stpcpy(journal, journal_prefix), name);
+
+		if (err) {
+			choose(dir, name, tmp, err);
+			continue;
+		}
+
+		if (lstatat(dir, tmp, &st)) {
+			msg("Sibling output not written", name);
+			err = ERROR;
+			continue;
+		}
+
+		draft_fd = draft_open(dir, draft);
+		if (draft_fd < 0) {
+			if (errno == EEXIST)
+				e = BUSY;
+			else {
+				pperror("open exclusive");
+				e = ERROR;
+			}
+			choose(dir, name, tmp, e);
+			err = e;
+			continue;
+		}
+
+		records.used = primary_end;
+
+		(void)(
+			(e = choose(dir, name, tmp, OK)) ||
+			(e = write_dep(dir, name, IS_SOURCE)) ||
+			(e = flush_deps(draft_fd, pos)) ||
+			(e = sibling_list(dir, name))
+		);
+
+		e = choose(dir, journal, draft, e);
+		close(draft_fd);
+
+		if (e)
+			err = e;
+	}
+
+	records.used = pos;
+	free(list);
+
+	return err;
+}
+
+
+static int
+unlink_cb(const char *name, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void) st;
+	(void) flag;
+	(void) ftw;
+
+	return remove(name);
+}
+
+
+/*
+	The worker's side. The files are placed into the sandbox directory
+	in REDO_WORKER_DIR (P_tmpdir by default). The recipe is run there
+	with REDO_REMOTE naming the file where depends-on appends the names
+	instead of updating them.
+*/
+
+static int
+work(void)
+{
+	char	name[PATH_MAX], *sandbox, *path, *data, *s, *eol,
+		*arg[4] = {"", "", "", ""};
+
+	const char *base = getenv("REDO_WORKER_DIR");
+
+	int	type, i, status = ERROR, dir = 0, ran = 0, exec, out_fd, err_fd;
+
+	size_t	len;
+
+	FILE	*out;
+
+
+	unsetenv("REDO_WORKER");
+
+	out = fdopen(dup(1), "w");
+	if (!out || (dup2(2, 1) < 0)) {	/* recipes' stdout goes to stderr */
+		perror("stdout");
+		return ERROR;
+	}
+
+	if (!base)
+		base = P_tmpdir;
+
+	sandbox = malloc(strlen(base) + sizeof "/redo-worker-XXXXXX");
+	if (!sandbox || !mkdtemp(strcpy(stpcpy(sandbox, base),
+						"/redo-worker-XXXXXX"))) {
+		perror("sandbox");
+		return ERROR;
+	}
+
+	path = malloc(strlen(sandbox) + sizeof "/deps" + PATH_MAX);
+	if (!path) {
+		perror("malloc");
+		return ERROR;
+	}
+
+	strcpy(stpcpy(path, sandbox), "/deps");
+	if (setenv("REDO_REMOTE", path, 1)) {
+		perror("setenv");
+		return ERROR;
+	}
+
+	while (!ran && (data = frame_get(stdin, &type, &len, name))) {
+		switch (type) {
+		case 'c':
+			strcpy(stpcpy(stpcpy(stpcpy(path, sandbox), "/"),
+							name), "/x");
+			spill(0, path, "", 0, 0);
+			if (!dir_enter(&dir, path))
+				ran = 1;
+			break;
+		case 'f':
+		case 'x':
+			spill(dir, name, data, len, type == 'x');
+			break;
+		case 'r':
+			for (i = 0, s = data;
+			     (i < 4) && (eol = strchr(s, '\n'));
+			     i++, s = eol + 1) {
+				*eol = '\0';
+				arg[i] = s;
 			}
-			close(dep_dir_fd);
+			strcpy(stpcpy(path, sandbox), "/log");
+			out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+			count(OPENS, 1);
+			err_fd = dup(2);
+			if ((out_fd < 0) || (err_fd < 0) ||
+			    (dup2(out_fd, 1) < 0) || (dup2(out_fd, 2) < 0))
+				perror("log");
+			else
+				status = fork_recipe(dir, -1, name, arg[0],
+						arg[1], arg[2], arg[3], 0);
+			if ((err_fd >= 0) &&
+			    ((dup2(err_fd, 1) < 0) || (dup2(err_fd, 2) < 0)))
+				status = ERROR;
+			close(err_fd);
+			close(out_fd);
+			s = slurp(0, path, &len, &exec);
+			frame_put(out, 'e', "-", s ? s : "", s ? len : 0);
+			free(s);
+			s = slurp(dir, arg[2], &len, &exec);
+			if (s)
+				frame_put(out, exec ? 'x' : 'f',
+							arg[2], s, len);
+			free(s);
+			strcpy(stpcpy(path, sandbox), "/deps");
+			s = slurp(0, path, &len, &exec);
+			frame_put(out, 'd', "-", s ? s : "", s ? len : 0);
+			free(s);
+			snprintf(name, sizeof name, "%d", status);
+			frame_put(out, 's', name, "", 0);
+			ran = 1;
+			break;
+		}
+		free(data);
+	}
+
+	nftw(sandbox, unlink_cb, 16, FTW_DEPTH | FTW_PHYS);
+
+	return (fclose(out) || !ran) ? ERROR : OK;
+}
+
+
+/* depends-on run by the worker's recipe only reports the names */
+
+static int
+report(const char *deps, int argc, char *argv[])
+{
+	FILE *f = fopen(deps, "a");
+	int i;
+
+	if (!f) {
+		perror(deps);
+		return ERROR;
+	}
+
+	for (i = 0; i < argc; i++)
+		fprintf(f, "%s\n", argv[i]);
+
+	return fclose(f) ? ERROR : OK;
+}
+
+
+/*
+	The prerequisites of make-format depfile (as written by cc -MD)
+	are appended to the arguments. The rules are "targets: names"
+	with backslash-newline continuations, "\ ", "\#" and "$$"
+	escapes. The targets of the rules are dropped.
+*/
+
+static int
+depfile_args(const char *depfile, int *argc, char ***argv)
+{
+	char	*text, *r, *w, *name, **args, c;
+
+	int	num = *argc, prereq = 0, exec;
+
+	size_t	len;
+
+
+	text = slurp(0, depfile, &len, &exec);
+	args = malloc((num + len / 2 + 2) * sizeof args[0]);
+	if (!text || !args) {
+		perror(depfile);
+		free(text);
+		free(args);
+		return ERROR;
+	}
+	text[len] = '\0';
+
+	memcpy(args, *argv, num * sizeof args[0]);
+
+	for (r = w = name = text; ; r++) {
+		if ((r[0] == '\\') && (r[1] == '\n'))
+			*++r = ' ';
+		else if ((r[0] == '\\') && (r[1] == '\r') && (r[2] == '\n'))
+			*(r += 2) = ' ';
+		else if ((r[0] == '\\') && ((r[1] == ' ') || (r[1] == '#'))) {
+			*w++ = *++r;
+			continue;
+		} else if ((r[0] == '$') && (r[1] == '$')) {
+			*w++ = *r++;
+			continue;
+		} else if ((r[0] == '#') && (w == name))
+			r += strcspn(r, "\n");		/* comment */
+
+		c = *r;
+
+		if (c && !strchr(" \t\r\n:", c)) {
+			*w++ = c;
+			continue;
+		}
+
+		if ((c == ':') && strchr(" \t\r\n", r[1])) {
+			prereq = 1;	/* "name:" is the target */
+			w = name;
+		} else if (c == ':') {
+			*w++ = c;	/* "c:/dir", not the separator */
+			continue;
+		}
+
+		if (prereq && (w > name)) {
+			*w++ = '\0';
+			args[num++] = name;
+		}
+		name = w;
+
+		if (c == '\n')
+			prereq = 0;
+		else if (!c)
+			break;
+	}
+
+	args[num] = 0;
+
+	*argc = num;
+	*argv = args;
+
+	return OK;
+}
+
+
+
+static int
+envint(const char *name)
+{
+	char *s = getenv(name);
+
+	return s ? strtol(s, 0, 10) : 0;
+}
+
+
+static double
+envfloat(const char *name)
+{
+	char *s = getenv(name);
+
+	return s ? strtod(s, 0) : 0;
+}
+
+
+static void
+hurry_up_on(int startup_or_success)
+{
+	static int night;
+
+
+	if (startup_or_success) {
+		night = SHORTEST;
+		return;
+	}
+
+	count(RETRIES, 1);
+	count(SLEPT, nap(night));
+
+	if (night < LONGEST)
+		night *= 2;
+}
+
+
+static void
+fence(int log_fd_buf, const char *top, const char *hill)
+{
+	if (log_fd > 0) {
+		if (log_fd != log_fd_buf) {
+			if (log_fd_buf <= 0)
+				dprintf(log_fd, top);
+		} else {
+			if (log_fd < 3)
+				dprintf(log_fd, hill);
 		}
 	}
+}
+
+
+typedef struct {
+	int	num,
+		todo,
+		done,
+		sorted,
+		urgents;
+	int32_t *status,
+		*children,
+		*child,
+		*urgent;
+	char	**name;
+} roadmap;
+
+
+static int
+text2int(int32_t *x, int n, char **p)
+{
+	char *ep;
+	long v;
+
+	while (n-- > 0) {
+		v = strtol(*p, &ep, 10);
+		if ((ep - *p) < (int) (sizeof (int32_t)))
+			return ERROR;
+		*p = ep;
+		*x++ = (int32_t) v;
+	}
 
-	*hint = err & HINTS;
+	return OK;
+}
 
-	return err & ERRORS;
+
+static int
+text2name(char **x, int n, char **p)
+{
+	while (n-- > 0) {
+		*p = strchr(*p, '\n');
+		if (*p == 0)
+			return ERROR;
+		*(*p)++ = '\0';
+		*x++ = *p;
+	}
+
+	return strchr(*p, '\n') != 0;	/* no more filenames allowed */
 }
 
 
-#define log_name() if (log_fd > 0)\
-	dprintf(log_fd, "%*s\"%s\",\n", indent, "", whole);
+static int
+test_map(roadmap *m)
+{
+	int i, j, n = m->num, low = m->children[0];
 
-#define log_err() if (log_fd > 0)\
-	dprintf(log_fd, "%*s{ err = %d },\n", indent, "", err)
 
-#define log_close_level() if (log_fd > 0)\
-	dprintf(log_fd, "%*s        t1 = %ld, err = %d\n%*s},\n",\
-			indent, "", process_times(), err, indent, "")
+	if (low != 0)
+		return ERROR;
 
+	for (i = 0; i < n; i++)
+		m->status[i] = 0;
+
+	for (i = 1, j = 0; i <= n; i++) {
+		int high = m->children[i];
+		if (high < low)
+			return ERROR;
+		while (j < high) {
+			int ch = m->child[j++];
+			if ((ch < 0) || (ch >= n))
+				return ERROR;
+			if (ch < i)
+				m->sorted = 0;
+			m->status[ch]++;
+		}
+		low = high;
+	}
+
+	return OK;
+}
 
-#define CR_WR_TR (O_CREAT | O_WRONLY | O_TRUNC)
 
 static int
-really_update_dep(int dir_fd, char *dep)
+import_map(roadmap *m, int fd)
 {
-	char	*whole, *recipe,
-		recipe_rel[PATH_MAX],
-		journal[NAME_MAX + 1],
-		draft  [NAME_MAX + 1],
-		family [NAME_MAX + 1];
+	struct stat st;
+	int num;
+	char *buf, *ptr;
 
-	int draft_fd, err = 0, up_to_date = 0, hint, new_recipe = 1;
 
-	struct stat st;
+	count(STATS, 1);
+	if (fstat(fd, &st) || (st.st_size >= (off_t) INT_MAX))
+		return ERROR;
 
-	FILE *journal_f;
+	buf = mmap(NULL, st.st_size + 1, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		return ERROR;
+
+	buf[st.st_size] = '\0';
+	ptr = strchr(buf, '\n');
+	if (!ptr)
+		return ERROR;
 
-	size_t whole_pos = track_used() + 1, dep_pos;
+	num = (ptr - buf) / sizeof (int64_t);
 
+	m->num  = num;
+	m->todo = num;
+	m->done = 0;
+	m->sorted = 1;
+	m->urgents = 0;
 
-	whole = track_append(dep);
-	if (!whole) {
-		msg("Dependency loop attempt", track_buf());
-		return wflag ? IS_SOURCE : ERROR;
+	m->name = (char **) buf;
+	m->status = (int32_t *) ptr;
+	m->children = m->status + num;
+	m->child = m->children + num + 1;
+
+	if (text2int(m->status, num, &ptr) ||
+	    text2int(m->children, num + 1, &ptr) ||
+	    text2int(m->child, m->children[num], &ptr) ||
+	    text2name(m->name, num, &ptr))
+		return ERROR;
+
+	return test_map(m);
+}
+
+
+static void
+init_map(roadmap *m, int n, char **argv)
+{
+	m->num  = n;
+	m->todo = n;
+	m->done = 0;
+	m->sorted = 0;
+	m->urgents = 0;
+
+	m->name = argv;
+	m->status = calloc(2 * n + 1, sizeof (int32_t));
+	if (!m->status) {
+		perror("calloc");
+		exit(ERROR);
 	}
+	m->children = m->status + n;
+}
 
-	dep_pos = strlen(whole) - strlen(dep);
 
-	log_name();
+static void
+approve(roadmap *m, int i)
+{
+	int	own = m->children[i],
+		num = m->children[i + 1] - own;
+	int32_t *ch = m->child + own;
 
-	if (fflag)
-		dprintf(1, "--[[\n");
+	m->status[i] = -1;
+	m->done++;
 
-	strcpy(family, dep);
-	recipe = find_recipe(family, recipe_rel, sizeof recipe_rel, whole);
+	while (num--)
+		m->status[*ch++]--;
+}
 
-	if (fflag)
-		dprintf(1, "--]]\n");
 
-	if (!recipe)
-		return IS_SOURCE;
+static int
+forget(roadmap *m, int i)
+{
+	int	own = m->children[i],
+		num = m->children[i + 1] - own;
 
+	if (num > 1)
+		return 0;
 
-	strcpy(stpcpy(journal, journal_prefix), dep);
-	datefile(journal, &st);
+	if (num == 1) {
+		int ch = m->child[own];
 
-	if (strcmp(hexdate, build_date) >= 0) {
-		err = (st.st_mode & S_IRUSR) ? OK : ERROR;
-		log_err();
-		return err;
+		if ((m->status[ch] > 1) || !forget(m, ch))
+			return 0;
 	}
 
+	m->status[i] = -1;
+	m->todo--;
 
-	strcpy(stpcpy(draft, draft_prefix), dep);
-	draft_fd = open(draft, O_CREAT | O_WRONLY | O_EXCL, 0666);
+	return 1;
+}
 
-	if (draft_fd < 0) {
-		if (errno == EEXIST)
-			err = BUSY | IMMEDIATE_DEPENDENCY;
-		else {
-			pperror("open exclusive");
-			err = ERROR;
-		}
-		log_err();
-		return err;
-	}
 
+/*
+	With -k the failed node is done, while all its dependents, which can
+	not be built, are skipped: they are never ready and are not to do.
+	The number of the skipped ones is returned.
+*/
 
-	log_time("{       t0 = %ld,");
+#define SKIPPED (INT32_MAX / 2)
 
-	journal_f = fopen(journal, "r");
+static int
+reject(roadmap *m, int i)
+{
+	int32_t *stack = malloc(m->num * sizeof (int32_t));
 
-	if (journal_f) {
-		char record[RECORD_SIZE];
-		char *filename = record + NAME_OFFSET;
+	int n = 0, k, skipped = 0;
 
-		while (read_record(record, journal_f, journal)) {
-			int self = !strcmp(filename, dep);
 
-			hint = IS_SOURCE;
+	m->status[i] = -1;
+	m->done++;
 
-			if ((new_recipe &&
-				(new_recipe = strcmp(filename, recipe_rel))) ||
-			    (!self &&
-				(err = update_dep(dir_fd, filename, &hint))) ||
-			    dep_changed(record, hint) ||
-			    (err = write_dep(draft_fd, filename,
-							UPDATED_RECENTLY)) ||
-			    (self && (up_to_date = 1)))
-								break;
-		}
+	if (!stack) {
+		perror("reject");
+		return 0;
+	}
 
-		fclose(journal_f);
-		hint = 0;
+	for (stack[n++] = i; n; ) {
+		i = stack[--n];
+		for (k = m->children[i]; k < m->children[i + 1]; k++) {
+			if ((m->status[m->child[k]] < 0) ||
+			    (m->status[m->child[k]] > SKIPPED / 2))
+				continue;
+			m->status[m->child[k]] = SKIPPED;
+			m->todo--;
+			skipped++;
+			stack[n++] = m->child[k];
+		}
 	}
 
-	if (new_recipe)
-		err = update_dep(dir_fd, recipe_rel, &hint);
+	free(stack);
+
+	return skipped;
+}
+
 
 /*
-	track.buf may be relocated during the nested update_dep() calls.
-	whole and target_rel reside in it and need to be refreshed.
+	Find the first node ready to be built, starting from i. The runs of
+	the nodes done are merged on the way, so that the next passes skip
+	them in one step. Scan always starts either from the beginning of
+	the map or next to the ready node, so the previous status is never
+	negative at the start.
 */
-	whole = track_buf() + whole_pos;
 
-	if (!err && !up_to_date) {
-		lseek(draft_fd, 0, SEEK_SET);
+static int
+next_ready(roadmap *m, int i)
+{
+	int step, prev, cur = 0, storage = 0;
 
-		(void)(
-			(err = write_dep(draft_fd, recipe_rel, hint)) ||
-			(err = run_recipe(draft_fd, recipe_rel, dep,
-					family, recipe - recipe_rel)) ||
-			(err = write_dep(draft_fd, dep, IS_SOURCE))
-		);
+	for ( ; i < m->num ; i += step) {
+		prev = cur;
+		cur = m->status[i];
 
-		if (err && (err != BUSY)) {
-			if (journal_f)
-				chmod(journal, st.st_mode & (~S_IRUSR));
+		if (cur == 0)
+			break;
+
+		if (cur > 0)
+			step = 1;
+		else {
+			step = - cur;
+			if (prev >= 0)
+				storage = i;
 			else
-				close(open(journal, CR_WR_TR, 0222));
-			log_guard(open_comment);
-			dprintf(2, "redo %*s%s\n     %*s%s -> %d\n",
-				indent,"", whole, indent,"", recipe_rel, err);
-			log_guard(close_comment);
+				m->status[storage] += cur;
 		}
 	}
 
-	close(draft_fd);
+	return i;
+}
 
-	log_close_level();
 
 /*
-	If fchdir() in update_dep() failed then we need to create
-	the full draft name inside the whole dep path.
+	If REDO_FAILED_FIRST=1 then the nodes which failed during the last
+	build, i.e. have their journals unreadable, are urgent. The ready
+	urgent nodes are tried first in every pass, so that the build going
+	to fail fails as early as possible.
 */
-	strcpy(whole + dep_pos, draft);
 
-	return choose(journal, whole, err) | UPDATED_RECENTLY;
+static void
+urgent_init(roadmap *m, int dir)
+{
+	char journal[PATH_MAX], *base;
+	struct stat st;
+	int i;
+
+	m->urgent = malloc(m->num * sizeof (int32_t));
+	if (!m->urgent)
+		return;
+
+	for (i = 0; i < m->num; i++) {
+		base = strrchr(m->name[i], '/');
+		base = base ? base + 1 : m->name[i];
+
+		if (snprintf(journal, sizeof journal, "%.*s%s%s",
+				(int) (base - m->name[i]), m->name[i],
+				journal_prefix, base) >= (int) sizeof journal)
+			continue;
+
+		count(STATS, 1);
+		if ((fstatat(at(dir), journal, &st, 0) == 0) &&
+		    !(st.st_mode & S_IRUSR))
+			m->urgent[m->urgents++] = i;
+	}
 }
 
 
-static int
-envint(const char *name)
+/*
+	With -c LIST the files changed since the last build are known, one
+	name per line (relative to the current directory, "-" is stdin).
+	The roadmap's children are the dependents, so only the nodes
+	reachable from the changed ones are walked, the rest are approved
+	and trusted to be up to date without opening their journals. The
+	roadmap should include the sources (MAP_SOURCES=1 for log2map.lua),
+	the name missing in the roadmap voids the list.
+*/
+
+static char *
+whole_name(int dir, char *name)
 {
-	char *s = getenv(name);
+	char *base = dir_enter(&dir, name), *whole;
 
-	return s ? strtol(s, 0, 10) : 0;
+	if (!base)
+		return 0;
+
+	whole = malloc(strlen(dir_path(dir)) + strlen(base) + 2);
+	if (whole)
+		strcpy(stpcpy(stpcpy(whole, dir_path(dir)), "/"), base);
+
+	return whole;
+}
+
+
+/* the failed nodes for the summary of -k */
+
+static void
+failure_add(buffer *failures, int dir, char *name)
+{
+	char *whole = whole_name(dir, name);
+
+	(void)(whole &&
+		!buffer_add(failures, "\t", 1) &&
+		!buffer_add(failures, whole, strlen(whole)) &&
+		buffer_add(failures, "\n", 1));
+
+	free(whole);
 }
 
 
 static int
-keepdir()
+by_name(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+static void
+trust_map(roadmap *m, int dir, const char *list)
 {
-	int fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	char	line[PATH_MAX], **keys = 0, **wholes, **key, **k, *hit;
 
-	if (fd < 0) {
-		perror("dir open");
-		exit(ERROR);
+	int32_t	*queue;
+
+	int	i, c, num = 0, head = 0, tail = 0, size = 0, trust;
+
+	FILE	*f = strcmp(list, "-") ? fopen(list, "r") : stdin;
+
+
+	if (!f) {
+		perror(list);
+		return;
+	}
+
+	while (fgets(line, sizeof line, f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!*line)
+			continue;
+		if (num == size) {
+			k = realloc(keys, (size = 2 * size + 64) * sizeof *k);
+			if (!k)
+				break;
+			keys = k;
+		}
+		keys[num] = whole_name(0, line);
+		if (!keys[num] && (keys[num] = malloc(strlen(dir_path(0)) +
+							strlen(line) + 2))) {
+			sprintf(keys[num], "%s/%s", dir_path(0), line);
+			tidy(keys[num]);	/* gone with its directory */
+		}
+		if (keys[num])
+			num++;
 	}
 
-	return fd;
+	if (f != stdin)
+		fclose(f);
+
+	qsort(keys, num, sizeof keys[0], by_name);
+
+	for (i = c = 0; i < num; i++)	/* unique */
+		if ((c == 0) || strcmp(keys[i], keys[c - 1]))
+			keys[c++] = keys[i];
+		else
+			free(keys[i]);
+	num = c;
+
+	wholes = calloc(m->num, sizeof wholes[0]);
+	queue = malloc(m->num * sizeof queue[0]);
+	hit = calloc(m->num + num, 1);
+	trust = wholes && queue && hit;
+
+
+	/* the changed nodes, and the ones which can not be named */
+
+	for (i = 0; trust && (i < m->num); i++) {
+		wholes[i] = whole_name(dir, m->name[i]);
+		key = wholes[i] ?
+			bsearch(wholes + i, keys, num, sizeof keys[0], by_name)
+			: 0;
+		if (key)
+			hit[m->num + (key - keys)] = 1;
+		if (key || !wholes[i]) {
+			hit[i] = 1;
+			queue[tail++] = i;
+		}
+	}
+
+	for (c = 0; trust && (c < num); c++)
+		if (!hit[m->num + c]) {
+			msg("Not in the roadmap, checking all", keys[c]);
+			trust = 0;
+		}
+
+
+	/* their dependents */
+
+	while (trust && (head < tail)) {
+		i = queue[head++];
+		for (c = m->children[i]; c < m->children[i + 1]; c++)
+			if (!hit[m->child[c]]) {
+				hit[m->child[c]] = 1;
+				queue[tail++] = m->child[c];
+			}
+	}
+
+
+	/* the rest is up to date */
+
+	for (i = 0; trust && (i < m->num); i++)
+		if (!hit[i]) {
+			verdict_put(wholes[i], 0);
+			approve(m, i);
+		}
+
+	for (i = 0; wholes && (i < m->num); i++)
+		free(wholes[i]);
+	for (i = 0; i < num; i++)
+		free(keys[i]);
+	free(wholes);
+	free(queue);
+	free(hit);
+	free(keys);
 }
 
 
-#define SHORTEST	10
-#define SCALEUPS	6
-#define LONGEST		(SHORTEST << SCALEUPS)
-
-#define MS_PER_S	1000
-#define NS_PER_MS	1000000
+/*
+	With -n the walk of -y is silent and the stale targets are printed
+	at the end, one whole name per line. Over the roadmap the stale nodes
+	are printed as the roadmap of their own, with the same names and the
+	edges between them.
+*/
 
 static void
-hurry_up_on(int startup_or_success)
+stale_list(void)
 {
-	static int night;
-	int asleep;
-	struct timespec s, r;
-
+	char **list = malloc((verdicts.num + 1) * sizeof (char *));
+	int i, n = 0;
 
-	if (startup_or_success) {
-		night = SHORTEST;
+	if (!list) {
+		perror("stale list");
 		return;
 	}
 
-	asleep = night + (rand() % night); /* ms */
+	for (i = 0; i < verdicts.size; i++)
+		if (verdicts.slot[i] && (*verdicts.slot[i] == '1'))
+			list[n++] = verdicts.slot[i] + 1;
 
-	if (night < LONGEST)
-		night *= 2;
+	qsort(list, n, sizeof list[0], by_name);
 
-	s.tv_sec  =  asleep / MS_PER_S;
-	s.tv_nsec = (asleep % MS_PER_S) * NS_PER_MS;
+	for (i = 0; i < n; i++)
+		printf("%s\n", list[i]);
 
-	nanosleep(&s, &r);
+	fflush(stdout);
+	free(list);
 }
 
 
 static void
-fence(int log_fd_buf, const char *top, const char *hill)
+stale_map(roadmap *m, int dir)
 {
-	if (log_fd > 0) {
-		if (log_fd != log_fd_buf) {
-			if (log_fd_buf <= 0)
-				dprintf(log_fd, top);
-		} else {
-			if (log_fd < 3)
-				dprintf(log_fd, hill);
+	int32_t *index = malloc(m->num * sizeof (int32_t) + 1),
+		*status = calloc(m->num + 1, sizeof (int32_t));
+
+	int i, k, n = 0, edges = 0;
+
+	char *whole;
+
+
+	for (i = 0; index && status && (i < m->num); i++) {
+		whole = whole_name(dir, m->name[i]);
+		index[i] = (whole && (verdict_get(whole) == 1)) ? n++ : -1;
+		free(whole);
+	}
+
+	if (!index || !status)
+		perror("stale map");
+	else if (n) {	/* nothing stale, nothing printed */
+		for (i = 0; i < m->num; i++)
+			for (k = m->children[i]; (index[i] >= 0) &&
+						 (k < m->children[i + 1]); k++)
+				if (index[m->child[k]] >= 0)
+					status[index[m->child[k]]]++;
+
+		for (i = 0; i < n; i++)
+			printf("<char *>");
+		printf("\n");
+
+		for (i = 0; i < n; i++)
+			printf(" %3d", status[i]);
+		printf("\n");
+
+		for (i = 0; i < m->num; i++) {
+			if (index[i] < 0)
+				continue;
+			printf(" %3d", edges);
+			for (k = m->children[i]; k < m->children[i + 1]; k++)
+				edges += (index[m->child[k]] >= 0);
 		}
+		printf(" %3d\n", edges);
+
+		for (i = 0; i < m->num; i++)
+			for (k = m->children[i]; (index[i] >= 0) &&
+						 (k < m->children[i + 1]); k++)
+				if (index[m->child[k]] >= 0)
+					printf(" %3d", index[m->child[k]]);
+
+		for (i = 0; i < m->num; i++)
+			if (index[i] >= 0)
+				printf("\n%s", m->name[i]);
+
+		fflush(stdout);
 	}
-}
 
+	free(index);
+	free(status);
+}
 
-typedef struct {
-	int	num,
-		todo,
-		done,
-		sorted;
-	int32_t *status,
-		*children,
-		*child;
-	char	**name;
-} roadmap;
 
+/*
+	If REDO_PROGRESS=1 then redo reports the roadmap's done and total
+	nodes, the target being built and the ETA. The ETA is the sum of the
+	REDO_TIMES times of the nodes left, the sources and the targets not
+	timed yet count as zero. The report is the status line on the
+	terminal, or the Lua table line written to REDO_PROGRESS_FD on every
+	change.
+*/
 
-static int
-text2int(int32_t *x, int n, char **p)
-{
-	char *ep;
-	long v;
+static struct {
+	roadmap	*map;
+	double	*eta, left;
+	int	fd, tty;
+	struct timespec since;
+} meter;
 
-	while (n-- > 0) {
-		v = strtol(*p, &ep, 10);
-		if ((ep - *p) < (int) (sizeof (int32_t)))
-			return ERROR;
-		*p = ep;
-		*x++ = (int32_t) v;
-	}
 
-	return OK;
+static void
+progress(const char *running)
+{
+	double	left = meter.left - elapsed(&meter.since);
+
+	int	secs = left > 0 ? (int) left : 0;
+
+	if (meter.fd > 0)
+		dprintf(meter.fd, "{ pid = %d, done = %d, todo = %d, "
+			"running = \"%s\", eta = %d },\n", getpid(),
+			meter.map->done, meter.map->todo,
+			running ? running : "", secs);
+	else if (meter.tty)
+		dprintf(2, "\r[%d/%d] %d:%02d %.60s\033[K",
+			meter.map->done, meter.map->todo,
+			secs / 60, secs % 60, running ? running : "");
 }
 
 
-static int
-text2name(char **x, int n, char **p)
+static void
+progress_running(int dir, const char *target)
 {
-	while (n-- > 0) {
-		*p = strchr(*p, '\n');
-		if (*p == 0)
-			return ERROR;
-		*(*p)++ = '\0';
-		*x++ = *p;
+	char *whole;
+
+	if (!meter.map)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &meter.since);
+	if (!target) {
+		progress(0);
+		return;
 	}
 
-	return strchr(*p, '\n') != 0;	/* no more filenames allowed */
+	whole = malloc(strlen(dir_path(dir)) + strlen(target) + 2);
+	if (whole)
+		sprintf(whole, "%s/%s", dir_path(dir), target);
+	progress(whole);
+	free(whole);
 }
 
 
-static int
-test_map(roadmap *m)
+static void
+progress_init(roadmap *m, int dir)
 {
-	int i, j, n = m->num, low = m->children[0];
+	int	i;
 
+	char	*whole;
 
-	if (low != 0)
-		return ERROR;
 
-	for (i = 0; i < n; i++)
-		m->status[i] = 0;
+	laps_load();
 
-	for (i = 1, j = 0; i <= n; i++) {
-		int high = m->children[i];
-		if (high < low)
-			return ERROR;
-		while (j < high) {
-			int ch = m->child[j++];
-			if ((ch < 0) || (ch >= n))
-				return ERROR;
-			if (ch < i)
-				m->sorted = 0;
-			m->status[ch]++;
+	meter.fd = envint("REDO_PROGRESS_FD");
+	meter.tty = (meter.fd <= 0) && (log_fd != 2) && isatty(2);
+	meter.eta = calloc(m->num + 1, sizeof (double));
+	if (!meter.eta)
+		return;
+
+	for (i = 0; i < m->num; i++)
+		if (m->status[i] >= 0) {
+			whole = whole_name(dir, m->name[i]);
+			meter.eta[i] = whole ? laps_get(whole) : 0;
+			meter.left += meter.eta[i];
+			free(whole);
 		}
-		low = high;
-	}
 
-	return OK;
+	meter.map = m;
+	progress_running(dir, 0);
 }
 
 
-static int
-import_map(roadmap *m, int fd)
+static void
+progress_done(int i)
 {
-	struct stat st;
-	int num;
-	char *buf, *ptr;
+	if (meter.map) {
+		meter.left -= meter.eta[i];
+		progress(0);
+	}
+}
 
 
-	if (fstat(fd, &st) || (st.st_size >= (off_t) INT_MAX))
-		return ERROR;
+static void
+progress_end(void)
+{
+	if (meter.tty)
+		dprintf(2, "\r\033[K");
+}
 
-	buf = mmap(NULL, st.st_size + 1, PROT_READ | PROT_WRITE,
-						MAP_PRIVATE, fd, 0);
-	close(fd);
-	if (buf == MAP_FAILED)
-		return ERROR;
 
-	buf[st.st_size] = '\0';
-	ptr = strchr(buf, '\n');
-	if (!ptr)
-		return ERROR;
+/*
+	The pass goes through the urgent nodes first and then through all
+	the nodes in the map's order. The position in the pass is mapped to
+	the node's index.
+*/
 
-	num = (ptr - buf) / sizeof (int64_t);
+static int
+next_pos(roadmap *m, int pos)
+{
+	for ( ; pos < m->urgents; pos++)
+		if (m->status[m->urgent[pos]] == 0)
+			return pos;
 
-	m->num  = num;
-	m->todo = num;
-	m->done = 0;
-	m->sorted = 1;
+	return m->urgents + next_ready(m, pos - m->urgents);
+}
 
-	m->name = (char **) buf;
-	m->status = (int32_t *) ptr;
-	m->children = m->status + num;
-	m->child = m->children + num + 1;
+#define node_at(m, pos) \
+	(((pos) < (m)->urgents) ? (m)->urgent[pos] : (pos) - (m)->urgents)
 
-	if (text2int(m->status, num, &ptr) ||
-	    text2int(m->children, num + 1, &ptr) ||
-	    text2int(m->child, m->children[num], &ptr) ||
-	    text2name(m->name, num, &ptr))
-		return ERROR;
 
-	return test_map(m);
-}
+static const char *const counter_name[COUNTERS] = {
+	"stat", "access", "open", "hashed", "cached", "journals", "records",
+	"recipes", "remotes", "busy", "retries", "slept", "throttled",
+	"processes"
+};
 
+/*
+	Every redo process appends its counters to the file shared via
+	REDO_STATS_FD as the single line. The process which created the
+	file sums them up and reports as Lua table fields.
+*/
 
-static void
-init_map(roadmap *m, int n, char **argv)
+static int
+stats_open(void)
 {
-	m->num  = n;
-	m->todo = n;
-	m->done = 0;
-	m->sorted = 0;
+	if (!envint("REDO_STATS"))
+		return -1;
 
-	m->name = argv;
-	m->status = calloc(2 * n + 1, sizeof (int32_t));
-	if (!m->status) {
-		perror("calloc");
-		exit(ERROR);
+	if (getenv("REDO_STATS_FD"))
+		return envint("REDO_STATS_FD");
+
+	stats_f = tmpfile();
+	if (!stats_f) {
+		perror("tmpfile");
+		return -1;
 	}
-	m->children = m->status + n;
+
+	fcntl(fileno(stats_f), F_SETFL, O_APPEND);
+	setenvint("REDO_STATS_FD", fileno(stats_f));
+
+	return fileno(stats_f);
 }
 
 
 static void
-approve(roadmap *m, int i)
+cancel_open(void)
 {
-	int	own = m->children[i],
-		num = m->children[i + 1] - own;
-	int32_t *ch = m->child + own;
+	FILE *f;
 
-	m->status[i] = -1;
-	m->done++;
+	struct sigaction sa = {.sa_handler = interrupt};
 
-	while (num--)
-		m->status[*ch++]--;
+
+	cancel_mode = kflag ? 0 : envint("REDO_CANCEL");
+	if (!cancel_mode)
+		return;
+
+	if (getenv("REDO_CANCEL_FD"))
+		cancel_fd = envint("REDO_CANCEL_FD");
+	else {
+		f = tmpfile();
+		if (!f) {
+			perror("cancel flag");
+			cancel_mode = 0;
+			return;
+		}
+		cancel_fd = fileno(f);
+		cancel_owner = 1;
+		setenvint("REDO_CANCEL_FD", cancel_fd);
+	}
+
+	if (cancel_mode > 1) {	/* no SA_RESTART, wait() is interrupted */
+		sigaction(SIGTERM, &sa, 0);
+		sigaction(SIGALRM, &sa, 0);
+	}
 }
 
 
-static int
-forget(roadmap *m, int i)
+static void
+stats_close(int stats_fd, int log_owner)
 {
-	int	own = m->children[i],
-		num = m->children[i + 1] - own;
+	char line[COUNTERS * 24];
+	int c, n = 0;
+	FILE *f = stats_f;
+
+	count(PROCESSES, 1);
+
+	if (!f) {
+		for (c = 0; c < COUNTERS; c++)
+			n += snprintf(line + n, sizeof line - n, "%ld%c",
+				counter[c], (c < COUNTERS - 1) ? ' ' : '\n');
+		if (write(stats_fd, line, n) != n)
+			pperror("write stats");
+		return;
+	}
 
-	if (num > 1)
-		return 0;
+	rewind(f);
+	while (1) {
+		long child[COUNTERS];
 
-	if (num == 1) {
-		int ch = m->child[own];
+		for (c = 0; (c < COUNTERS) && (fscanf(f, "%ld", child + c) == 1); c++);
+		if (c < COUNTERS)
+			break;
+		for (c = 0; c < COUNTERS; c++)
+			counter[c] += child[c];
+	}
+	fclose(f);
 
-		if ((m->status[ch] > 1) || !forget(m, ch))
-			return 0;
+	if (log_owner)
+		dprintf(log_fd, "%*sstats = {", INDENT_PER_LEVEL, "");
+	else {
+		log_guard(open_comment);
+		dprintf(2, "stats = {");
 	}
 
-	m->status[i] = -1;
-	m->todo--;
+	for (c = 0; c < COUNTERS; c++)
+		dprintf(log_owner ? log_fd : 2, " %s = %ld,",
+					counter_name[c], counter[c]);
 
-	return 1;
+	if (log_owner)
+		dprintf(log_fd, " },\n");
+	else {
+		dprintf(2, " }\n");
+		log_guard(close_comment);
+	}
 }
 
 
 #define HELP "redo-c-weft-8\n"\
-"Usage: redo [-weft] [-l <logname>] [-m <roadmap>] [TARGET [...]]\n"\
-"       depends-on [-weft] [DEP [...]]\n"
+"Usage: redo [-weftkyn] [-l <logname>] [-m <roadmap> [-c <changed>]]"\
+" [TARGET [...]]\n"\
+"       depends-on [-weft] [-d <depfile>] [DEP [...]]\n"\
+"       depends-on -o OUTPUT [...]\n"\
+"       redo -W\n"
 
 
 #define RETRIES_DEFAULT 10
@@ -1279,18 +4932,26 @@ forget(roadmap *m, int i)
 int
 main(int argc, char *argv[])
 {
-	int	opt, log_fd_prev, fd = -1, map_fd = -1, dir_fd = keepdir(),
-		retries_max, retries, i, hint, err = OK,
-		step, prev, cur, storage;
+	int	opt, log_fd_prev, fd = -1, map_fd = -1, dir = 0,
+		retries_max, retries, i, pos, hint, err = OK, stats_fd,
+		serve = 0, siblings = 0, failed = 0, skipped = 0;
 
 	roadmap map;
 
+	char *deps, *depfile = 0, *changed = 0, *map_name = 0;
+
+	buffer failures = {0};
+
 
 	log_fd = log_fd_prev = envint("REDO_LOG_FD");
 
+	unsetenv("REDO_AUTODEP_LOG");	/* not traced by the shim anymore */
+
+	dirs_init();
+
 	opterr = 0;
 
-	while ((opt = getopt(argc, argv, "+weftl:m:")) != -1) {
+	while ((opt = getopt(argc, argv, "+weftkynoWc:d:l:m:")) != -1) {
 		switch (opt) {
 		case 'w':
 			setenvint("REDO_WARNING", 1);
@@ -1304,6 +4965,27 @@ main(int argc, char *argv[])
 		case 't':
 			setenvint("REDO_TRACE", 1);
 			break;
+		case 'k':
+			setenvint("REDO_KEEP_GOING", 1);
+			break;
+		case 'W':
+			serve = 1;
+			break;
+		case 'd':
+			depfile = optarg;
+			break;
+		case 'n':
+			nflag = 1;
+			/* fall through */
+		case 'y':
+			yflag = 1;
+			break;
+		case 'c':
+			changed = optarg;
+			break;
+		case 'o':
+			siblings = 1;
+			break;
 		case 'l':
 			if (strcmp(optarg, "1") == 0)
 				log_fd = 1;
@@ -1319,10 +5001,11 @@ main(int argc, char *argv[])
 			setenvint("REDO_LOG_FD", log_fd);
 			break;
 		case 'm':
+			map_name = optarg;
 			map_fd = open(optarg, O_RDONLY);
 			if ((map_fd >= 0) && (
 				(import_map(&map, map_fd) != OK) ||
-				(!file_chdir(&dir_fd, optarg))
+				(!dir_enter(&dir, optarg))
 							)) {
 					dprintf(2, "Bad map : %s\n", optarg);
 					return ERROR;
@@ -1334,12 +5017,55 @@ main(int argc, char *argv[])
 		}
 	}
 
+	if (changed && !map_name) {
+		msg("No roadmap to trust", "-c");
+		return ERROR;
+	}
+
+	if (depfile && depfile_args(depfile, &argc, &argv))
+		return ERROR;
+
+	if (siblings) {
+		deps = getenv("REDO_OUTPUTS");
+		if (!deps) {
+			msg("Not run by the local recipe", "depends-on -o");
+			return ERROR;
+		}
+		return report(deps, argc - optind, argv + optind);
+	}
+
+	deps = getenv("REDO_REMOTE");
+	if (deps && strcmp(base_name(argv[0]), "redo"))
+		return report(deps, argc - optind, argv + optind);
+
 	wflag = envint("REDO_WARNING");
 	eflag = envint("REDO_RECIPES");
 	fflag = envint("REDO_FIND");
 	tflag = envint("REDO_TRACE");
+	kflag = envint("REDO_KEEP_GOING");
+	durability = envint("REDO_DURABILITY");
+	prefetching = envint("REDO_PREFETCH");
+	verify_jobs = envint("REDO_VERIFY_JOBS");
+	load_max = envfloat("REDO_LOAD");
+	pressure_max = envfloat("REDO_PRESSURE");
 	date_build("REDO_BUILD_DATE");
 	track_init(getenv("REDO_TRACK"));
+
+	if (serve)
+		return work();
+
+	worker = getenv("REDO_WORKER");
+	autodep = getenv("REDO_AUTODEP");
+	if (autodep && !*autodep)
+		autodep = 0;
+	if (autodep && !getenv("REDO_AUTODEP_ROOT"))
+		setenv("REDO_AUTODEP_ROOT", dir_path(0), 1);
+	rounds = envint("REDO_ROUNDS");
+	if (rounds <= 0)
+		rounds = ROUNDS_DEFAULT;
+
+	stats_fd = stats_open();
+	cancel_open();
 	retries_max = envint("REDO_RETRIES");
 	unsetenv("REDO_RETRIES");
 
@@ -1352,50 +5078,112 @@ main(int argc, char *argv[])
 	if (map_fd < 0)
 		init_map(&map, argc - optind, argv + optind);
 
+	if (changed && (map_fd >= 0))
+		trust_map(&map, dir, changed);
+
+	laps.file = getenv("REDO_TIMES");
+	if (envint("REDO_PROGRESS") && (fd <= 0))
+		progress_init(&map, dir);
+
+	if (envint("REDO_FAILED_FIRST"))
+		urgent_init(&map, dir);
+
+	if (yflag) {
+		verify_jobs = 0;
+		if (!nflag)
+			dprintf(1, "return {\n");
+	}
+
 	srand(getpid());
 	fence(log_fd_prev, "return {\n", close_comment);
 	retries = retries_max;
 
 	do {
-		hurry_up_on(retries-- == retries_max);
+		hurry_up_on((retries-- == retries_max) && !pool_full);
+		pool_full = 0;
 
-		for (i = 0, cur = 0; i < map.num ; i += step) {
-			prev = cur;
-			cur = map.status[i];
-
-			if (cur >= 0)
-				step = 1;
-			else {
-				step = - cur;
-				if (prev >= 0)
-					storage = i;
-				else
-					map.status[storage] += cur;
+		for (pos = next_pos(&map, 0); pos < map.urgents + map.num;
+					pos = next_pos(&map, pos + 1)) {
+			i = node_at(&map, pos);
+			if (cancelled()) {
+				err = ERROR;
+				break;
 			}
-
-			if (cur == 0) {
-				err = update_dep(dir_fd, map.name[i], &hint);
-				if (!err && (fd > 0))
-					err = write_dep(fd, map.name[i], hint);
-
-				if (!err) {
-					approve(&map, i);
-					retries = retries_max;
-					if (map.sorted)
-						break;
-				} else if (err != BUSY) {
-					err = ERROR;
+			err = update_dep(dir, map.name[i], &hint);
+			if (!err && (fd > 0))
+				err = write_dep(dir, map.name[i], hint);
+
+			if (!err) {
+				approve(&map, i);
+				progress_done(i);
+				retries = retries_max;
+				if (map.sorted)
+					break;
+			} else if ((err != BUSY) && kflag) {
+				failed++;
+				skipped += reject(&map, i);
+				failure_add(&failures, dir, map.name[i]);
+				err = OK;
+				retries = retries_max;
+				if (map.sorted)
 					break;
-				} else if (hint & IMMEDIATE_DEPENDENCY)
+			} else if (err != BUSY) {
+				err = ERROR;
+				break;
+			} else {
+				count(BUSIES, 1);
+				if (hint & IMMEDIATE_DEPENDENCY)
 					forget(&map, i);
 			}
 		}
+		if (pool_full)
+			retries++;	/* the pool wait costs no retry */
 	} while ((err != ERROR) && (map.done < map.todo) && (retries > 0));
 
+	progress_end();
+
+	if (stats_fd >= 0)
+		stats_close(stats_fd, (log_fd > 0) && (log_fd != log_fd_prev));
+
 	fence(log_fd_prev, "}\n", open_comment);
 
-	if (err != ERROR)
+	if (nflag) {
+		if (map_fd >= 0)
+			stale_map(&map, dir);
+		else
+			stale_list();
+	} else if (yflag)
+		dprintf(1, "}\n");
+
+	if ((fd > 0) && flush_deps(fd, 0))
+		err = ERROR;
+
+	if ((durability == BATCHED) && (track_used() == 0))
+		settle_all();
+
+	if ((err != ERROR) && cancelled())
+		err = ERROR;
+	else if (err != ERROR)
 		err = (map.done < map.num) ? BUSY : OK;
+	else
+		cancel();
+
+	if (failed) {
+		if (fd <= 0) {
+			log_guard(open_comment);
+			dprintf(2, "redo -k : %d failed, %d skipped\n%.*s",
+				failed, skipped,
+				(int) failures.used, failures.buf);
+			log_guard(close_comment);
+		}
+		err = ERROR;
+	}
+	free(failures.buf);
+
+	if (terminated) {	/* the drafts are removed, die as asked */
+		signal(SIGTERM, SIG_DFL);
+		raise(SIGTERM);
+	}
 
 	return err;
 }
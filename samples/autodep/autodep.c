@@ -0,0 +1,173 @@
+/* LD_PRELOAD shim reporting the files opened by the recipe.
+
+   Every regular file successfully opened for reading is appended to the
+   file named by REDO_AUTODEP_LOG as the absolute path, one per line.
+   redo sets both the variable and LD_PRELOAD for the recipes if
+   REDO_AUTODEP is the path of this library:
+
+	redo autodep.so
+	REDO_AUTODEP=$PWD/autodep.so redo all
+
+   The paths are not normalized here, redo does it while recording.
+*/
+
+
+#define _GNU_SOURCE 1
+
+#include <sys/stat.h>
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_openat)(int, const char *, int, ...);
+static FILE *(*real_fopen)(const char *, const char *);
+
+
+static void
+resolve(void)
+{
+	if (!real_open) {
+		real_open   = dlsym(RTLD_NEXT, "open");
+		real_openat = dlsym(RTLD_NEXT, "openat");
+		real_fopen  = dlsym(RTLD_NEXT, "fopen");
+	}
+}
+
+
+static void
+note(int dirfd, const char *path, int flags, int fd)
+{
+	char	line[2 * PATH_MAX + 2], link[32], *log, *s;
+
+	int	saved = errno, log_fd;
+
+	ssize_t	len;
+
+	struct stat st;
+
+
+	if ((fd < 0) || ((flags & O_ACCMODE) != O_RDONLY) || !path ||
+	    !(log = getenv("REDO_AUTODEP_LOG")) ||
+	    fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return;
+
+	if (*path == '/')
+		s = line;
+	else if (dirfd == AT_FDCWD) {
+		if (!getcwd(line, PATH_MAX))
+			goto out;
+		s = line + strlen(line);
+		*s++ = '/';
+	} else {
+		snprintf(link, sizeof link, "/proc/self/fd/%d", dirfd);
+		len = readlink(link, line, PATH_MAX);
+		if (len <= 0)
+			goto out;
+		s = line + len;
+		*s++ = '/';
+	}
+
+	len = snprintf(s, line + sizeof line - s, "%s\n", path);
+	if ((len <= 0) || (s + len >= line + sizeof line) ||
+	    strchr(path, '\n'))
+		goto out;
+
+	log_fd = real_open(log, O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (log_fd >= 0) {
+		if (write(log_fd, line, s + len - line) < 0)
+			(void) 0;	/* nothing to be done */
+		close(log_fd);
+	}
+out:
+	errno = saved;
+}
+
+
+#define MODE(flags) \
+	mode_t mode = 0;\
+	if (((flags) & O_CREAT) || (((flags) & O_TMPFILE) == O_TMPFILE)) {\
+		va_list ap;\
+		va_start(ap, flags);\
+		mode = va_arg(ap, mode_t);\
+		va_end(ap);\
+	}
+
+
+int
+open(const char *path, int flags, ...)
+{
+	int fd;
+
+	MODE(flags)
+
+	resolve();
+	fd = real_open(path, flags, mode);
+	note(AT_FDCWD, path, flags, fd);
+
+	return fd;
+}
+
+
+int
+openat(int dirfd, const char *path, int flags, ...)
+{
+	int fd;
+
+	MODE(flags)
+
+	resolve();
+	fd = real_openat(dirfd, path, flags, mode);
+	note(dirfd, path, flags, fd);
+
+	return fd;
+}
+
+
+FILE *
+fopen(const char *path, const char *how)
+{
+	FILE *f;
+
+	resolve();
+	f = real_fopen(path, how);
+	if (f)
+		note(AT_FDCWD, path, strchr(how, '+') || (*how != 'r') ?
+					O_RDWR : O_RDONLY, fileno(f));
+
+	return f;
+}
+
+
+/* The aliases glibc programs link with */
+
+int open64(const char *, int, ...) __attribute__((alias("open")));
+int openat64(int, const char *, int, ...) __attribute__((alias("openat")));
+FILE *fopen64(const char *, const char *) __attribute__((alias("fopen")));
+
+
+int
+__open_2(const char *path, int flags)
+{
+	return open(path, flags);
+}
+
+
+int
+__openat_2(int dirfd, const char *path, int flags)
+{
+	return openat(dirfd, path, flags);
+}
+
+
+int __open64_2(const char *, int) __attribute__((alias("__open_2")));
+int __openat64_2(int, const char *, int)
+				__attribute__((alias("__openat_2")));
@@ -0,0 +1,170 @@
+-- End-to-end benchmark of redo over the playground projects.
+--
+-- Usage:
+--
+--   lua bench.lua [ kind [ nodes [ jobs ] ] ] > result.lua
+--
+-- kind  - "mesh" or "tree". Default is "mesh".
+-- nodes - number of nodes in the generated project. Default is 1000.
+-- jobs  - number of redo instances for the parallel build. Default is 4.
+--
+-- BENCH_DIR - project directory. Default is "bench.work".
+-- STRACE    - if not empty, then syscalls are counted with strace.
+
+local kind  = arg[1] or "mesh"
+local nodes = math.floor(tonumber(arg[2]) or 1000)
+local jobs  = math.floor(tonumber(arg[3]) or 4)
+
+assert(kind == "mesh" or kind == "tree", "Unknown kind " .. kind)
+
+if nodes < 10 then nodes = 10 end
+if jobs < 1 then jobs = 1 end
+
+
+local Quote = function(s)
+  return "'" .. s:gsub("'", "'\\''") .. "'"
+end
+
+local Assert = function(cmd, msg)
+  local success, how, exit_code = os.execute(cmd)
+  if not success then
+    io.stderr:write((msg or cmd) .. "\n")
+    os.exit(exit_code)
+  end
+end
+
+local Absolute = function(path)
+  if path:sub(1, 1) == "/" then return path end
+  local f = assert(io.popen("pwd"))
+  local cwd = f:read()
+  f:close()
+  return cwd .. "/" .. path
+end
+
+
+local here = Absolute(arg[0]:match("(.-)[^/]*$"))
+local playground = here .. "../parallel/playground/"
+local work = Absolute(os.getenv("BENCH_DIR") or "bench.work")
+local measure = here .. "measure"
+local strace = os.getenv("STRACE") or ""
+
+
+Assert("redo " .. Quote(measure))
+
+
+-------------------------
+-- Project generation --
+-------------------------
+
+Assert("rm -rf " .. Quote(work) .. " && mkdir -p " .. Quote(work))
+
+local gen
+
+if kind == "mesh" then
+  local sources = math.max(10, nodes // 4)
+  gen = ("lua %s %d %d 5"):format(Quote(playground .. "mkmesh.lua"), nodes, sources)
+else
+  local coef = 3
+  gen = ("lua %s %d %d"):format(Quote(playground .. "mktree.lua"), nodes // coef, coef)
+end
+
+Assert("cd " .. Quote(work) .. " && " .. gen)
+
+
+-- zero-cost recipe replacing the playground one
+
+local f = assert(io.open(work .. "/recipe", "w"))
+assert(f:write("depends-on $DEPS\ncat $DEPS > $3\n"))
+f:close()
+
+
+-- sources are the plain files
+
+local source = {}
+
+local ls = assert(io.popen("cd " .. Quote(work) .. " && ls"))
+
+for name in ls:lines() do
+  if name:match("%.do$") then
+    for src in io.lines(work .. "/" .. name) do
+      for s in src:gmatch("t%d+%.src") do
+        source[s] = true
+      end
+    end
+  end
+end
+
+ls:close()
+
+local touched
+
+for name in pairs(source) do
+  local f = assert(io.open(work .. "/" .. name, "w"))
+  assert(f:write(name, "\n"))
+  f:close()
+  touched = touched or name
+end
+
+
+---------------
+-- Scenarios --
+---------------
+
+local Run = function(cmd)
+  local syscalls = ""
+  local so = work .. "/strace.out"
+
+  if strace ~= "" then
+    cmd = ("strace -f -qq -c -o %s sh -c %s"):format(Quote(so), Quote(cmd))
+  end
+
+  local f = assert(io.popen(("cd %s && %s %s 2>>bench.err"):format(
+    Quote(work), Quote(measure), Quote(cmd .. " >/dev/null"))))
+  local fields = f:read("a")
+  f:close()
+
+  if strace ~= "" then
+    for l in io.lines(so) do
+      local t = {}
+      for w in l:gmatch("%S+") do t[#t + 1] = w end
+      if t[#t] == "total" then
+        syscalls = (", syscalls = %d"):format(tonumber(t[#t - 2]) or 0)
+      end
+    end
+  end
+
+  return "{ " .. fields .. syscalls .. " }"
+end
+
+
+local result = {}
+
+local Scenario = function(name, cmd)
+  result[#result + 1] = ("  %s = %s,\n"):format(name, Run(cmd))
+end
+
+
+Scenario("clean", "redo t")
+
+Scenario("noop", "redo t")
+
+Assert("sleep 1")  -- journals keep ctime with 1 second resolution
+Assert(("echo touched >> %s/%s"):format(Quote(work), touched))
+Scenario("touch", "redo t")
+
+
+-- roadmap from the full-graph log of the no-op build
+
+Assert(("cd %s && redo -l bench.log t && MAP_DIR=%s lua %s bench.log > t.map"):format(
+  Quote(work), Quote(work), Quote(playground .. "../log2map.lua")))
+
+Assert(("cd %s && rm -f .do..*"):format(Quote(work)))
+
+Scenario("parallel", ("for I in $(seq %d); do redo -m t.map & done; wait"):format(jobs))
+
+
+io.write("return {\n")
+io.write(("  kind = %q, nodes = %d, jobs = %d, strace = %s,\n"):format(
+  kind, nodes, jobs, tostring(strace ~= "")))
+io.write(table.concat(result))
+io.write("}\n")
@@ -0,0 +1,296 @@
+/* Microbenchmarks of redo's hot kernels.
+
+   redo.c is included as is, so that its static functions are measured
+   exactly as they are compiled into redo. Every kernel is repeated
+   REPS times and min/median/max throughput is reported as Lua table.
+
+	kernels [ scale ] > kernels.lua
+
+   scale multiplies the sizes of the synthetic inputs, default is 1.
+*/
+
+
+#define main redo_main
+#include "../../redo.c"
+#undef main
+
+
+#define REPS 9
+
+static int scale = 1;
+
+static char scratch[] = "/tmp/redo-kernels-XXXXXX";
+
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int
+by_value(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+
+/*
+	Run the kernel REPS times and report the throughput of items per
+	second. The kernel returns the number of items processed.
+*/
+
+static void
+measure(const char *name, const char *unit, double per_unit,
+						long (*kernel)(void))
+{
+	double rate[REPS], t;
+	long items;
+	int i;
+
+	for (i = 0; i < REPS; i++) {
+		t = now();
+		items = kernel();
+		t = now() - t;
+		rate[i] = items / per_unit / (t > 0 ? t : 1e-9);
+	}
+
+	qsort(rate, REPS, sizeof rate[0], by_value);
+
+	printf("  %s = { unit = \"%s\", min = %.3f, median = %.3f, "
+		"max = %.3f, items = %ld },\n",
+		name, unit, rate[0], rate[REPS / 2], rate[REPS - 1], items);
+}
+
+
+/* sha256 as fed by rehash() */
+
+#define HASH_BYTES (16 << 20)
+
+static uint8_t *hash_input;
+
+static long
+k_sha256(void)
+{
+	struct sha256 ctx;
+	unsigned char hash[HASH_LEN];
+	long len = (long) HASH_BYTES * scale, done;
+
+	sha256_init(&ctx);
+	for (done = 0; done < len; done += 4096)
+		sha256_update(&ctx, hash_input + done % HASH_BYTES, 4096);
+	sha256_sum(&ctx, hash);
+
+	return len;
+}
+
+
+/* find_record() scanning the whole journal */
+
+#define JOURNAL_RECORDS 100000
+
+static long
+k_find_record(void)
+{
+	char name[] = "t";
+
+	if (find_record(0, name) != OK)
+		exit(ERROR);
+
+	return (long) JOURNAL_RECORDS * scale + 1;
+}
+
+
+/* track_append() at the depth of the generated chain */
+
+#define TRACK_DEPTH	64
+#define TRACK_APPENDS	100000
+
+static long
+k_track_append(void)
+{
+	char dep[32];
+	long i, n = (long) TRACK_APPENDS * scale;
+
+	for (i = 0; i < n; i++) {
+		size_t cutoff = track_used();
+
+		snprintf(dep, sizeof dep, "leaf.%ld", i);
+		if (!track_append(0, dep))
+			exit(ERROR);
+		track_truncate(cutoff);
+	}
+
+	return n;
+}
+
+
+/* find_recipe() climbing from the deep directory */
+
+#define RECIPE_LOOKUPS 20000
+
+static char *whole;
+static int deep;
+
+static long
+k_find_recipe(void)
+{
+	char family[NAME_MAX + 1], recipe_rel[PATH_MAX];
+	long i, n = (long) RECIPE_LOOKUPS * scale;
+
+	for (i = 0; i < n; i++) {
+		strcpy(family, "x.y.z.o");
+		if (!find_recipe(deep, family, recipe_rel, sizeof recipe_rel,
+								whole))
+			exit(ERROR);
+	}
+
+	return n;
+}
+
+
+/* text2int() over the roadmap-formatted numbers */
+
+#define MAP_INTS 1000000
+
+static char *ints_text;
+static int32_t *ints;
+
+static long
+k_text2int(void)
+{
+	char *p = ints_text;
+	int n = MAP_INTS * scale;
+
+	if (text2int(ints, n, &p))
+		exit(ERROR);
+
+	return n;
+}
+
+
+/* next_ready() passes over the map, the fraction of nodes is approved
+   per pass, the rest is busy */
+
+#define MAP_NODES	1000000
+#define MAP_PASSES	8
+
+static char *map_names[1];
+
+static long
+k_next_ready(void)
+{
+	roadmap m;
+	int i, pass, n = MAP_NODES * scale;
+	long scanned = 0;
+
+	init_map(&m, n, map_names);
+	m.child = m.status;
+
+	for (pass = 0; pass < MAP_PASSES; pass++) {
+		for (i = next_ready(&m, 0); i < n; i = next_ready(&m, i + 1)) {
+			scanned++;
+			if ((i % MAP_PASSES) <= pass)
+				approve(&m, i);
+		}
+	}
+
+	free(m.status);
+
+	return scanned;
+}
+
+
+static void
+setup(void)
+{
+	FILE *f;
+	long i;
+	uint32_t x = 1;
+	char dir[PATH_MAX], deep_name[] = "a/b/c/d/x.y.z.o", *p;
+
+
+	if (!mkdtemp(scratch) || chdir(scratch)) {
+		perror(scratch);
+		exit(ERROR);
+	}
+
+	dirs_init();
+
+	hash_input = malloc(HASH_BYTES);
+	if (!hash_input)
+		exit(ERROR);
+	for (i = 0; i < HASH_BYTES; i++)
+		hash_input[i] = (x = x * 1103515245 + 12345) >> 24;
+
+	f = fopen(".do..t", "w");
+	if (!f)
+		exit(ERROR);
+	for (i = 0; i < (long) JOURNAL_RECORDS * scale; i++)
+		fprintf(f, "%064ld %016lx ../src/dep%ld.h\n", i, i, i);
+	fprintf(f, "%064d %016x t\n", 0, 0);
+	fclose(f);
+
+	track_init("");
+	for (i = 0; i < TRACK_DEPTH; i++) {
+		snprintf(dir, sizeof dir, "node.%ld", i);
+		if (!track_append(0, dir))
+			exit(ERROR);
+	}
+
+	if ((close(open(".o.do", O_CREAT | O_WRONLY, 0666)) < 0) ||
+	    mkdir("a", 0777) || mkdir("a/b", 0777) ||
+	    mkdir("a/b/c", 0777) || mkdir("a/b/c/d", 0777) ||
+	    !dir_enter(&deep, deep_name)) {
+		perror("recipes tree");
+		exit(ERROR);
+	}
+	whole = malloc(strlen(dir_path(deep)) + sizeof "/x.y.z.o");
+	if (!whole)
+		exit(ERROR);
+	strcpy(stpcpy(whole, dir_path(deep)), "/x.y.z.o");
+
+	ints = malloc((size_t) MAP_INTS * scale * sizeof ints[0]);
+	p = ints_text = malloc((size_t) MAP_INTS * scale * 8 + 1);
+	if (!ints || !p)
+		exit(ERROR);
+	for (i = 0; i < (long) MAP_INTS * scale; i++)
+		p += sprintf(p, " %3ld", (i * 7919) % 100000);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	char dir_rm[sizeof scratch + sizeof "rm -rf "];
+
+	if (argc > 1)
+		scale = strtol(argv[1], 0, 10);
+	if (scale < 1)
+		scale = 1;
+
+	setup();
+
+	printf("return {\n  scale = %d, reps = %d,\n", scale, REPS);
+
+	measure("sha256", "MB/s", 1 << 20, k_sha256);
+	measure("find_record", "records/s", 1, k_find_record);
+	measure("track_append", "appends/s", 1, k_track_append);
+	measure("find_recipe", "lookups/s", 1, k_find_recipe);
+
+	measure("text2int", "ints/s", 1, k_text2int);
+	measure("next_ready", "nodes/s", 1, k_next_ready);
+
+	printf("}\n");
+
+	snprintf(dir_rm, sizeof dir_rm, "rm -rf %s", scratch);
+
+	return system(dir_rm) ? ERROR : OK;
+}
@@ -0,0 +1,76 @@
+/* Run the shell command and report its resources usage as the fields
+   of Lua table:
+
+	measure 'redo -l 2 t 2>t.log'
+
+   wall, utime and stime are in seconds, maxrss in kilobytes. The exit
+   code of the command is passed through.
+*/
+
+
+#define _GNU_SOURCE 1
+
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+
+static double
+seconds(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	struct timespec t0, t1;
+	struct rusage ru;
+	int status;
+	pid_t pid;
+
+
+	if (argc != 2) {
+		dprintf(2, "Usage: measure COMMAND\n");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+
+	if (pid == 0) {
+		execl("/bin/sh", "/bin/sh", "-c", argv[1], (char *)0);
+		perror("execl");
+		_exit(127);
+	}
+
+	if (wait4(pid, &status, 0, &ru) < 0) {
+		perror("wait4");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	status = WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+
+	printf("wall = %.6f, utime = %.6f, stime = %.6f, maxrss = %ld, "
+		"minflt = %ld, majflt = %ld, nvcsw = %ld, nivcsw = %ld, "
+		"status = %d",
+		(t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+		seconds(&ru.ru_utime), seconds(&ru.ru_stime), ru.ru_maxrss,
+		ru.ru_minflt, ru.ru_majflt, ru.ru_nvcsw, ru.ru_nivcsw,
+		status);
+
+	return status;
+}
@@ -7,12 +7,21 @@ local BUSY = 75
 
 local node = {}
 
+local sources = os.getenv("MAP_SOURCES")
+
 local explore
 
 explore = function(dep, target)
   for i, name in ipairs(dep) do
     local record = dep[i + 1]
-    if type(record) == "table" then
+    if type(name) ~= "string" then
+      -- tdo times and nested tables
+    elseif type(record) ~= "table" then
+      if sources and target then -- the source, followed by the next name
+        node[name] = node[name] or {0}
+        node[name][target] = true
+      end
+    else
       if not node[name] then
         node[name] = {record.err}
       end
@@ -0,0 +1,288 @@
+---------------------------------------------------------------
+-- Simulate the roadmap-driven parallel build offline        --
+--                                                           --
+--   MAP_DIR=$(pwd) lua simulate.lua t.roadmap t.log ...     --
+---------------------------------------------------------------
+
+local jobs = {}
+
+for n in (os.getenv("SIM_JOBS") or "1 2 4 8 16"):gmatch("%d+") do
+  if tonumber(n) > 0 then jobs[#jobs + 1] = math.tointeger(tonumber(n)) end
+end
+
+
+---------------------
+-- Reading roadmap --
+---------------------
+
+local mapname = assert(..., "Usage: lua simulate.lua roadmap [ log ... ]")
+
+local f = assert(io.open(mapname), mapname)
+
+local Ints = function(line)
+  local t = {}
+  for n in (line or ""):gmatch("%-?%d+") do
+    t[#t + 1] = math.tointeger(tonumber(n))
+  end
+  return t
+end
+
+local placeholders = assert(f:read("l"), "Bad map : " .. mapname)
+local num = #placeholders // #"<char *>"
+
+local status = Ints(f:read("l"))
+local children = Ints(f:read("l"))
+local child = Ints(f:read("l"))
+
+local dict = {}
+
+for i = 1, num do
+  dict[i] = assert(f:read("l"), "Bad map : " .. mapname)
+end
+
+f:close()
+
+assert(#status == num and #children == num + 1, "Bad map : " .. mapname)
+
+
+-------------------------------------------
+-- Recipes' durations from the Lua logs --
+-------------------------------------------
+
+-- The recipe's wall time includes the nested builds run by its depends-on,
+-- which follow the tdo time in the record. explore() returns the record's
+-- total time and the time of its own recipe.
+
+local wall = {}
+
+local explore
+
+explore = function(dep)
+  local total, inside, started = 0, 0, false
+  for i, name in ipairs(dep) do
+    local record = dep[i + 1]
+    if type(name) == "number" then
+      started = true -- tdo
+    elseif type(name) == "string" and type(record) == "table" then
+      local t, own = explore(record)
+      if own then wall[name] = own end
+      total = total + t
+      if started then inside = inside + t end
+    end
+  end
+  if not dep.usage then
+    return total
+  end
+  return total - inside + dep.usage.wall, math.max(dep.usage.wall - inside, 0)
+end
+
+for i = 2, select("#", ...) do
+  local logname = select(i, ...)
+  local log = assert(loadfile(logname), logname .. " failed")
+  explore(log())
+end
+
+
+-- the log's names are made relative just as log2map.lua does
+
+local map_dir = os.getenv("MAP_DIR")
+
+if map_dir then
+  map_dir = map_dir .. "/"
+
+  local find_slashes = function(s)
+    local t = {}
+    for i in s:gmatch("()/") do
+      t[#t + 1] = i
+    end
+    return t
+  end
+
+  local map_dir_slash = find_slashes(map_dir)
+
+  local relative = {}
+
+  for name, w in pairs(wall) do
+    local name_slash = find_slashes(name)
+
+    local eq_cnt, eq_pos
+
+    for i, map_pos in ipairs(map_dir_slash) do
+      if map_pos ~= name_slash[i] then break end
+      if map_dir:sub(1, map_pos) ~= name:sub(1, name_slash[i]) then break end
+      eq_cnt, eq_pos = i, map_pos
+    end
+
+    if eq_cnt then
+      relative[("../"):rep(#map_dir_slash - eq_cnt) .. name:sub(eq_pos + 1, -1)] = w
+    end
+  end
+
+  wall = relative
+end
+
+local duration, work, timed = {}, 0, 0
+
+for i, name in ipairs(dict) do
+  duration[i] = wall[name] or 0
+  work = work + duration[i]
+  if wall[name] then timed = timed + 1 end
+end
+
+
+-------------------
+-- Critical path --
+-------------------
+
+-- the longest path from the node to the end of the build, node included
+
+local level = {}
+
+do
+  local order, pending = {}, {}
+
+  for i = 1, num do
+    pending[i] = status[i]
+    if pending[i] == 0 then order[#order + 1] = i end
+  end
+
+  local k = 1
+  while k <= #order do
+    local i = order[k]
+    for c = children[i] + 1, children[i + 1] do
+      local j = child[c] + 1
+      pending[j] = pending[j] - 1
+      if pending[j] == 0 then order[#order + 1] = j end
+    end
+    k = k + 1
+  end
+
+  assert(#order == num, "Dependency loop in " .. mapname)
+
+  for k = num, 1, -1 do
+    local i, longest = order[k], 0
+    for c = children[i] + 1, children[i + 1] do
+      longest = math.max(longest, level[child[c] + 1])
+    end
+    level[i] = duration[i] + longest
+  end
+end
+
+local critical_path = 0
+
+for i = 1, num do
+  critical_path = math.max(critical_path, level[i])
+end
+
+
+----------------
+-- Scheduling --
+----------------
+
+-- binary heap ordered by "before"
+
+local Heap = function(before)
+  local h = {}
+
+  local push = function(x)
+    local k = #h + 1
+    h[k] = x
+    while k > 1 and before(h[k], h[k // 2]) do
+      h[k], h[k // 2] = h[k // 2], h[k]
+      k = k // 2
+    end
+  end
+
+  local pop = function()
+    local top, n = h[1], #h
+    h[1] = h[n]
+    h[n] = nil
+    n = n - 1
+    local k = 1
+    while true do
+      local m = k
+      for c = 2 * k, math.min(2 * k + 1, n) do
+        if before(h[c], h[m]) then m = c end
+      end
+      if m == k then break end
+      h[k], h[m] = h[m], h[k]
+      k = m
+    end
+    return top
+  end
+
+  return push, pop, function() return #h end
+end
+
+
+-- fifo mimics redo scanning the roadmap in order, critical prefers the
+-- nodes heading the longest paths
+
+local policies = {
+  fifo = function(a, b) return a < b end,
+  critical = function(a, b)
+    if level[a] ~= level[b] then return level[a] > level[b] end
+    return a < b
+  end,
+}
+
+local Simulate = function(workers, before)
+  local pending = {}
+  local push_ready, pop_ready, ready = Heap(before)
+  local finish = {}
+  local push_running, pop_running, running = Heap(function(a, b)
+    if finish[a] ~= finish[b] then return finish[a] < finish[b] end
+    return a < b
+  end)
+
+  for i = 1, num do
+    pending[i] = status[i]
+    if pending[i] == 0 then push_ready(i) end
+  end
+
+  local now = 0
+
+  while ready() > 0 or running() > 0 do
+    while ready() > 0 and running() < workers do
+      local i = pop_ready()
+      finish[i] = now + duration[i]
+      push_running(i)
+    end
+
+    local i = pop_running()
+    now = finish[i]
+    for c = children[i] + 1, children[i + 1] do
+      local j = child[c] + 1
+      pending[j] = pending[j] - 1
+      if pending[j] == 0 then push_ready(j) end
+    end
+  end
+
+  return now
+end
+
+
+---------------------
+-- Writing results --
+---------------------
+
+local Ratio = function(a, b)
+  return b > 0 and a / b or 1
+end
+
+io.write("return {\n")
+io.write(("  nodes = %d, timed = %d,\n"):format(num, timed))
+io.write(("  work = %.6f, critical_path = %.6f, parallelism = %.3f,\n"):format(
+  work, critical_path, Ratio(work, critical_path)))
+
+for _, policy in ipairs{"fifo", "critical"} do
+  io.write(("  %s = {\n"):format(policy))
+  for _, n in ipairs(jobs) do
+    local makespan = Simulate(n, policies[policy])
+    io.write(("    { jobs = %d, makespan = %.6f, speedup = %.3f, utilization = %.3f },\n"):format(
+      n, makespan, Ratio(work, makespan), Ratio(work, n * makespan)))
+  end
+  io.write("  },\n")
+end
+
+io.write("}\n")